@@ -67,6 +67,18 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API std::future<storage_outcome<void>> download_blob_to_stream(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os);
 
+        /// <summary>
+        /// Intitiates an asynchronous operation  to download the contents of a blob directly to an output sink, such as a range of a file or a caller-owned buffer.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
+        /// <param name="size">The size of the data to download from the blob, in bytes.</param>
+        /// <param name="sink">The target sink.  Its size() is the number of bytes received, once the operation completes.</param>
+        /// <param name="if_match">If not empty, the blob is only downloaded if its ETag matches this value.  Otherwise, the operation fails with 412.</param>
+        /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<void>> download_blob_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::shared_ptr<storage_output_sink> sink, const std::string &if_match = std::string());
+
         /// <summary>
         /// Intitiates an asynchronous operation  to upload the contents of a blob from a stream.
         /// </summary>
@@ -74,8 +86,18 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="is">The source stream.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
-        AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata);
+        /// <returns>A <see cref="std::future" /> object that represents the current operation, and holds the ETag of the blob's new version.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<std::string>> upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata);
+
+        /// <summary>
+        /// Intitiates an asynchronous operation  to upload the contents of a blob from an input source, which is read without being copied to a stream.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="source">The source of the content, which must remain valid until the operation completes.</param>
+        /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
+        /// <returns>A <see cref="std::future" /> object that represents the current operation, and holds the ETag of the blob's new version.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<std::string>> upload_block_blob_from_source(const std::string &container, const std::string &blob, std::shared_ptr<storage_input_source> source, const std::vector<std::pair<std::string, std::string>> &metadata);
 
         /// <summary>
         /// Intitiates an asynchronous operation  to delete a blob.
@@ -112,16 +134,19 @@ namespace microsoft_azure { namespace storage {
         /// </summary>
         /// <param name="prefix">The container name prefix.</param>
         /// <param name="include_metadata">A bool value, return metadatas if it is true.</param>
+        /// <param name="max_results">The maximum number of containers to return in one response.</param>
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
-        AZURE_STORAGE_API std::future<storage_outcome<list_containers_response>> list_containers(const std::string &prefix, bool include_metadata = false);
+        AZURE_STORAGE_API std::future<storage_outcome<list_containers_response>> list_containers(const std::string &prefix, bool include_metadata = false, int max_results = max_list_results);
 
         /// <summary>
         /// Intitiates an asynchronous operation  to list all blobs.
         /// </summary>
         /// <param name="container">The container name.</param>
         /// <param name="prefix">The blob name prefix.</param>
+        /// <param name="max_results">The maximum number of blobs to return in one response.</param>
+        /// <param name="includes">The additional datasets to return with each blob.</param>
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
-        AZURE_STORAGE_API std::future<storage_outcome<list_blobs_response>> list_blobs(const std::string &container, const std::string &prefix);
+        AZURE_STORAGE_API std::future<storage_outcome<list_blobs_response>> list_blobs(const std::string &container, const std::string &prefix, int max_results = max_list_results, list_blobs_request_base::include includes = list_blobs_request_base::include::unspecifies);
 
         /// <summary>
         /// Intitiates an asynchronous operation  to list blobs in segments.
@@ -130,8 +155,10 @@ namespace microsoft_azure { namespace storage {
         /// <param name="delimiter">The delimiter used to designate the virtual directories.</param>
         /// <param name="continuation_token">A continuation token returned by a previous listing operation.</param>
         /// <param name="prefix">The blob name prefix.</param>
+        /// <param name="max_results">The maximum number of blobs and virtual directories to return in one response.</param>
+        /// <param name="includes">The additional datasets to return with each blob.</param>
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
-        AZURE_STORAGE_API std::future<storage_outcome<list_blobs_hierarchical_response>> list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix);
+        AZURE_STORAGE_API std::future<storage_outcome<list_blobs_hierarchical_response>> list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int max_results = max_list_results, list_blobs_hierarchical_request_base::include includes = list_blobs_hierarchical_request_base::include::unspecifies);
 
         /// <summary>
         /// Intitiates an asynchronous operation  to get the property of a blob.
@@ -159,6 +186,16 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_from_stream(const std::string &container, const std::string &blob, const std::string &blockid, std::istream &is);
 
+        /// <summary>
+        /// Intitiates an asynchronous operation  to upload a block of a blob from an input source, which is read without being copied to a stream.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="blockid">A Base64-encoded block ID that identifies the block.</param>
+        /// <param name="source">The source of the block, which must remain valid until the operation completes.</param>
+        /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, std::shared_ptr<storage_input_source> source);
+
         /// <summary>
         /// Intitiates an asynchronous operation  to create a block blob with existing blocks.
         /// </summary>
@@ -166,8 +203,9 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="block_list">A <see cref="std::vector"> that contains all blocks in order.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
-        AZURE_STORAGE_API std::future<storage_outcome<void>> put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata);
+        /// <param name="if_match">If not empty, the block list is only committed if the blob's ETag matches this value.</param>
+        /// <returns>A <see cref="std::future" /> object that represents the current operation, and holds the ETag of the blob's new version.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<std::string>> put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata, const std::string &if_match = std::string());
 
         /// <summary>
         /// Intitiates an asynchronous operation  to create an append blob.
@@ -296,6 +334,14 @@ namespace microsoft_azure { namespace storage {
             return m_valid && (m_blobClient != NULL);
         }
 
+        /// <summary>
+        /// Gets the counts of the transfers made so far, and of the new connections and TLS handshakes they needed.
+        /// </summary>
+        curl_connection_stats connection_stats() const
+        {
+            return m_blobClient->client()->connection_stats();
+        }
+
         /// <summary>
         /// Constructs a blob client wrapper from storage account credential.
         /// </summary>
@@ -342,7 +388,8 @@ namespace microsoft_azure { namespace storage {
         /// </summary>
         /// <param name="prefix">The container name prefix.</param>
         /// <param name="include_metadata">A bool value, return metadatas if it is true.</param>
-        std::vector<list_containers_item> list_containers(const std::string &prefix, bool include_metadata = false);
+        /// <param name="max_results">The maximum number of containers to return.</param>
+        std::vector<list_containers_item> list_containers(const std::string &prefix, bool include_metadata = false, int max_results = max_list_results);
 
         /* blob level */
 
@@ -353,7 +400,9 @@ namespace microsoft_azure { namespace storage {
         /// <param name="delimiter">The delimiter used to designate the virtual directories.</param>
         /// <param name="continuation_token">A continuation token returned by a previous listing operation.</param>
         /// <param name="prefix">The blob name prefix.</param>
-        list_blobs_hierarchical_response list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix);
+        /// <param name="max_results">The maximum number of blobs and virtual directories to return in this segment.  A small value is enough to check whether a prefix has any blobs.</param>
+        /// <param name="includes">The additional datasets to return with each blob.</param>
+        list_blobs_hierarchical_response list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int max_results = max_list_results, list_blobs_hierarchical_request_base::include includes = list_blobs_hierarchical_request_base::include::unspecifies);
 
         /// <summary>
         /// Uploads the contents of a blob from a local file, file size need to be equal or smaller than 64MB.
@@ -362,7 +411,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
+        /// <returns>The ETag of the blob's new version, or an empty string if the upload failed.</returns>
+        std::string put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
         /// <summary>
         /// Uploads the contents of a blob from a stream.
@@ -373,6 +423,43 @@ namespace microsoft_azure { namespace storage {
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
         void upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
+        /// <summary>
+        /// Uploads a single block of a block blob from a stream.  The block is not part of the blob until it is committed with put_block_list.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="blockid">A Base64-encoded block ID that identifies the block.  All block IDs of a blob must have the same length.</param>
+        /// <param name="is">The source stream.</param>
+        void upload_block_from_stream(const std::string &container, const std::string blob, const std::string &blockid, std::istream &is);
+
+        /// <summary>
+        /// Uploads a single block of a block blob from an input source, such as a range of a file, without copying it to a stream.  The block is not part of the blob until it is committed with put_block_list.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="blockid">A Base64-encoded block ID that identifies the block.  All block IDs of a blob must have the same length.</param>
+        /// <param name="source">The source of the block.</param>
+        void upload_block_from_source(const std::string &container, const std::string blob, const std::string &blockid, std::shared_ptr<storage_input_source> source);
+
+        /// <summary>
+        /// Commits a block blob from the given list of blocks, which must already have been uploaded.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="block_list">A <see cref="std::vector"> that contains all blocks in order.</param>
+        /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
+        /// <param name="if_match">If not empty, the block list is only committed if the blob's ETag matches this value.  Otherwise, errno is set to 412.</param>
+        /// <returns>The ETag of the blob's new version, or an empty string if the commit failed.</returns>
+        std::string put_block_list(const std::string &container, const std::string blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), const std::string &if_match = std::string());
+
+        /// <summary>
+        /// Gets the list of blocks of a block blob.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <returns>A <see cref="get_block_list_response"> object, with the committed and uncommitted blocks of the blob, in order.</returns>
+        get_block_list_response get_block_list(const std::string &container, const std::string &blob);
+
         /// <summary>
         /// Uploads the contents of a blob from a local file.
         /// </summary>
@@ -381,7 +468,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
         /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        void upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 8);
+        /// <returns>The ETag of the blob's new version, or an empty string if the upload failed.</returns>
+        std::string upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 8);
 
         /// <summary>
         /// Downloads the contents of a blob to a stream.
@@ -394,12 +482,36 @@ namespace microsoft_azure { namespace storage {
         void download_blob_to_stream(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os);
 
         /// <summary>
-        /// Downloads the contents of a blob to a local file.
+        /// Downloads the contents of a blob into a range of a file, with pwrite.  At most size bytes are written.
         /// </summary>
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
         /// <param name="size">The size of the data to download from the blob, in bytes.</param>
+        /// <param name="fd">The target file descriptor.</param>
+        /// <param name="fd_offset">The offset in the file at which to write the data, in bytes.</param>
+        /// <param name="if_match">If not empty, the range is only downloaded if the blob's ETag matches this value.  Otherwise, errno is set to 412.</param>
+        /// <returns>The number of bytes written to the file, which is less than size if the blob ends before the range does.</returns>
+        unsigned long long download_blob_to_fd(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, int fd, unsigned long long fd_offset, const std::string &if_match = std::string());
+
+        /// <summary>
+        /// Downloads the contents of a blob into a caller-owned buffer.  At most size bytes are written.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
+        /// <param name="size">The size of the data to download from the blob, in bytes.  The buffer must have room for at least this many bytes.</param>
+        /// <param name="buffer">The target buffer.</param>
+        /// <returns>The number of bytes written to the buffer, which is less than size if the blob ends before the range does.</returns>
+        unsigned long long download_blob_to_buffer(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, char *buffer);
+
+        /// <summary>
+        /// Downloads the contents of a blob to a local file.
+        /// The file is preallocated to the size of the blob, and the blob is downloaded in 4MB ranges, in parallel.  Each range is written at its own offset as soon as it arrives.
+        /// If any range fails, errno is set to the error of the first range that failed, and the contents of the file are undefined.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
         /// <param name="destPath">The target file path.</param>
         /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
         void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, size_t parallel = 9);
@@ -437,6 +549,9 @@ namespace microsoft_azure { namespace storage {
     private:
         blob_client_wrapper() {}
 
+        // Runs a download into the sink, and returns the number of bytes it received.
+        unsigned long long download_blob_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::shared_ptr<storage_output_sink> sink, const std::string &if_match = std::string());
+
         std::shared_ptr<blob_client> m_blobClient;
         std::mutex s_mutex;
         unsigned int m_concurrency;
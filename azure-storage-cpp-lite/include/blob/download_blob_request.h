@@ -39,11 +39,21 @@ namespace microsoft_azure {
                 return *this;
             }
 
+            std::string if_match() const override {
+                return m_if_match;
+            }
+
+            download_blob_request &set_if_match(const std::string &if_match) {
+                m_if_match = if_match;
+                return *this;
+            }
+
         private:
             std::string m_container;
             std::string m_blob;
             unsigned long long m_start_byte;
             unsigned long long m_end_byte;
+            std::string m_if_match;
         };
     }
 }
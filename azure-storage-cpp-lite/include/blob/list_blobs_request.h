@@ -9,7 +9,9 @@ class list_blobs_request : public list_blobs_request_base {
 public:
     list_blobs_request(const std::string &container, const std::string &prefix)
         : m_container(container),
-          m_prefix(prefix) {}
+          m_prefix(prefix),
+          m_maxresults(0),
+          m_includes(include::unspecifies) {}
 
     std::string container() const override {
         return m_container;
@@ -27,6 +29,10 @@ public:
         return m_maxresults;
     }
 
+    include includes() const override {
+        return m_includes;
+    }
+
     list_blobs_request &set_marker(const std::string &marker) {
         m_marker = marker;
         return *this;
@@ -37,11 +43,17 @@ public:
         return *this;
     }
 
+    list_blobs_request &set_includes(include includes) {
+        m_includes = includes;
+        return *this;
+    }
+
 private:
     std::string m_container;
     std::string m_prefix;
     std::string m_marker;
     int m_maxresults;
+    include m_includes;
 };
 
 class list_blobs_hierarchical_request : public list_blobs_hierarchical_request_base {
@@ -51,7 +63,8 @@ public:
           m_prefix(prefix),
           m_marker(continuation_token),
           m_delimiter(delimiter),
-          m_maxresults(0) {}
+          m_maxresults(0),
+          m_includes(include::unspecifies) {}
 
     std::string container() const override {
         return m_container;
@@ -73,6 +86,10 @@ public:
         return m_maxresults;
     }
 
+    include includes() const override {
+        return m_includes;
+    }
+
     list_blobs_hierarchical_request &set_marker(const std::string &marker) {
         m_marker = marker;
         return *this;
@@ -83,12 +100,18 @@ public:
         return *this;
     }
 
+    list_blobs_hierarchical_request &set_includes(include includes) {
+        m_includes = includes;
+        return *this;
+    }
+
 private:
     std::string m_container;
     std::string m_prefix;
     std::string m_marker;
     std::string m_delimiter;
     int m_maxresults;
+    include m_includes;
 };
 }
 }
@@ -37,11 +37,21 @@ public:
         return *this;
     }
 
+    std::string if_match() const override {
+        return m_if_match;
+    }
+
+    put_block_list_request &set_if_match(const std::string &if_match) {
+        m_if_match = if_match;
+        return *this;
+    }
+
 private:
     std::string m_container;
     std::string m_blob;
     std::vector<block_item> m_block_list;
     std::vector<std::pair<std::string, std::string>> m_metadata;
+    std::string m_if_match;
 };
 
 }
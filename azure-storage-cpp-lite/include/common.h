@@ -8,6 +8,9 @@
 namespace microsoft_azure {
     namespace storage {
 
+        // The largest number of items the service returns from a single list request.
+        const int max_list_results = 5000;
+
         enum class lease_status {
             locked,
             unlocked
@@ -121,7 +121,7 @@ namespace microsoft_azure {
                         {
                             auto error = context->xml_parser()->parse_storage_error(str);
                             error.code = std::to_string(result);
-                            *outcome = storage_outcome<RESPONSE_TYPE>(error);
+                            *outcome = storage_outcome<RESPONSE_TYPE>(std::move(error));
                             //*outcome = storage_outcome<RESPONSE_TYPE>(context->xml_parser()->parse_storage_error(str));
                             retry->add_result(result);
                             async_executor<RESPONSE_TYPE>::submit_helper(promise, outcome, account, request, http, context, retry);
@@ -129,13 +129,13 @@ namespace microsoft_azure {
                         else
                         {
                             *outcome = storage_outcome<RESPONSE_TYPE>(context->xml_parser()->parse_response<RESPONSE_TYPE>(str));
-                            promise->set_value(*outcome);
+                            promise->set_value(std::move(*outcome));
                         }
                     }, info.interval());
                 }
                 else
                 {
-                    promise->set_value(*outcome);
+                    promise->set_value(std::move(*outcome));
                 }
             }
 
@@ -199,7 +199,7 @@ namespace microsoft_azure {
                         {
                             auto error = context->xml_parser()->parse_storage_error(str);
                             error.code = std::to_string(result);
-                            *outcome = storage_outcome<void>(error);
+                            *outcome = storage_outcome<void>(std::move(error));
                             //*outcome = storage_outcome<void>(context->xml_parser()->parse_storage_error(str));
                             retry->add_result(result);
                             async_executor<void>::submit_helper(promise, outcome, account, request, http, context, retry);
@@ -207,13 +207,13 @@ namespace microsoft_azure {
                         else
                         {
                             *outcome = storage_outcome<void>();
-                            promise->set_value(*outcome);
+                            promise->set_value(std::move(*outcome));
                         }
                     }, info.interval());
                 }
                 else
                 {
-                    promise->set_value(*outcome);
+                    promise->set_value(std::move(*outcome));
                 }
             }
 
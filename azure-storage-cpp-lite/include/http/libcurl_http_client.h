@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <cstring>
 #include <condition_variable>
 #include <functional>
 #include <future>
@@ -13,6 +14,8 @@
 #include <thread>
 #include <vector>
 
+#include <strings.h>
+
 #include <curl/curl.h>
 
 #include "storage_EXPORTS.h"
@@ -24,6 +27,49 @@ namespace microsoft_azure {
 
         class CurlEasyClient;
 
+        // Counts of the transfers made by a CurlEasyClient, and of the connections they needed, to show how often connections and TLS sessions are reused.
+        struct curl_connection_stats {
+            unsigned long long transfers;
+            unsigned long long new_connections; // Transfers that had to open a connection, rather than reuse an open one.
+            unsigned long long tls_handshakes; // New connections that made a TLS handshake.
+            unsigned long long tls_handshake_microseconds; // Total time spent in those handshakes.
+        };
+
+        // Runs transfers with curl's multi interface on a single event-loop thread, so that a request in flight doesn't tie up a thread of its own.
+        // Completion callbacks run on the event-loop thread, so they must not block.
+        class CurlMultiEngine : public std::enable_shared_from_this<CurlMultiEngine> {
+        public:
+            AZURE_STORAGE_API CurlMultiEngine();
+
+            AZURE_STORAGE_API ~CurlMultiEngine();
+
+            // Starts the event-loop thread.
+            AZURE_STORAGE_API void start();
+
+            // Stops the event-loop thread.  Transfers that haven't completed are abandoned, and their callbacks aren't called.
+            AZURE_STORAGE_API void stop();
+
+            // Starts the transfer of the given handle, which must be set up, once the given delay has passed.  done is called with the result when it completes.
+            AZURE_STORAGE_API void add(CURL *h, std::chrono::seconds delay, std::function<void(CURLcode)> done);
+
+        private:
+            struct transfer {
+                CURL *handle;
+                std::function<void(CURLcode)> done;
+            };
+
+            void run();
+            void wake();
+
+            CURLM *m_multi;
+            int m_wake_pipe[2]; // Written to by add() and stop(), to wake the event loop from curl_multi_wait().
+            std::mutex m_mutex;
+            std::multimap<std::chrono::steady_clock::time_point, transfer> m_delayed; // Transfers waiting for their delay to pass.
+            std::map<CURL *, std::function<void(CURLcode)>> m_running; // Only used on the event-loop thread.
+            bool m_stop;
+            std::thread m_thread;
+        };
+
         class CurlEasyRequest : public http_base {
 
             using MY_TYPE = CurlEasyRequest;
@@ -61,16 +107,21 @@ namespace microsoft_azure {
                 }
             }
 
+            // Header names are case-insensitive; the service sends "ETag", for example, where constants::header_etag is "Etag".
             std::string get_header(const std::string &name) const override {
                 auto iter = m_headers.find(name);
                 if (iter != m_headers.end())
                 {
                     return iter->second;
                 }
-                else
+                for (iter = m_headers.begin(); iter != m_headers.end(); ++iter)
                 {
-                    return "";
+                    if (strcasecmp(iter->first.c_str(), name.c_str()) == 0)
+                    {
+                        return iter->second;
+                    }
                 }
+                return "";
             }
             const std::map<std::string, std::string>& get_headers() const {
                 return m_headers;
@@ -78,11 +129,8 @@ namespace microsoft_azure {
 
             AZURE_STORAGE_API http_code perform() override;
 
-            void submit(std::function<void(http_code, storage_istream)> cb, std::chrono::seconds interval) override {
-                std::this_thread::sleep_for(interval);
-                perform();
-                cb(m_code, m_error_stream);
-            }
+            // Runs the request on the client's CurlMultiEngine, after the given interval, without blocking.  cb is called on the engine's thread.
+            AZURE_STORAGE_API void submit(std::function<void(http_code, storage_istream)> cb, std::chrono::seconds interval) override;
 
             void reset() override {
                 m_headers.clear();
@@ -111,6 +159,14 @@ namespace microsoft_azure {
 
             void set_output_stream(storage_ostream s) override {
                 m_output_stream = s;
+                m_output_sink = std::make_shared<storage_stream_sink>(s);
+                check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write));
+                check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
+            }
+
+            void set_output_sink(std::shared_ptr<storage_output_sink> s) override {
+                m_output_stream = storage_ostream();
+                m_output_sink = s;
                 check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write));
                 check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
             }
@@ -124,6 +180,14 @@ namespace microsoft_azure {
 
             void set_input_stream(storage_istream s) override {
                 m_input_stream = s;
+                m_input_source = std::make_shared<storage_stream_source>(s);
+                check_code(curl_easy_setopt(m_curl, CURLOPT_READFUNCTION, read));
+                check_code(curl_easy_setopt(m_curl, CURLOPT_READDATA, this));
+            }
+
+            void set_input_source(std::shared_ptr<storage_input_source> s) override {
+                m_input_stream = storage_istream();
+                m_input_source = s;
                 check_code(curl_easy_setopt(m_curl, CURLOPT_READFUNCTION, read));
                 check_code(curl_easy_setopt(m_curl, CURLOPT_READDATA, this));
             }
@@ -150,7 +214,11 @@ namespace microsoft_azure {
             //IN_CB m_input_callback;
             //OUT_CB m_output_callback;
             storage_istream m_input_stream;
+            std::shared_ptr<storage_input_source> m_input_source;
+            unsigned long long m_input_offset; // How much of the body has been sent in this attempt.
             storage_ostream m_output_stream;
+            std::shared_ptr<storage_output_sink> m_output_sink;
+            unsigned long long m_output_offset; // How much of the body has been received in this attempt.
             storage_iostream m_error_stream;
             std::function<bool(http_code)> m_switch_error_callback;
 
@@ -159,6 +227,12 @@ namespace microsoft_azure {
 
             AZURE_STORAGE_API static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata);
 
+            // Sets the options of the handle for the request, up to (but not including) running it.
+            void prepare();
+
+            // Adds the transfer that just completed to the client's connection statistics.
+            void record_transfer();
+
             /*static size_t write_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
                 MY_TYPE *p = static_cast<MY_TYPE *>(userdata);
                 p->m_output_callback(buffer, size * nitems);
@@ -172,8 +246,16 @@ namespace microsoft_azure {
 
             static size_t write(char *buffer, size_t size, size_t nitems, void *userdata) {
                 MY_TYPE *p = static_cast<MY_TYPE *>(userdata);
-                p->m_output_stream.ostream().write(buffer, size * nitems);
-                return size * nitems;
+                if (!p->m_output_sink) {
+                    return size * nitems;
+                }
+                ssize_t actual_size = p->m_output_sink->write(buffer, size * nitems, p->m_output_offset);
+                if (actual_size < 0) {
+                    // Anything other than the full size fails the transfer.
+                    return 0;
+                }
+                p->m_output_offset += actual_size;
+                return actual_size;
             }
 
             static size_t error(char *buffer, size_t size, size_t nitems, void *userdata) {
@@ -184,15 +266,14 @@ namespace microsoft_azure {
 
             static size_t read(char *buffer, size_t size, size_t nitems, void *userdata) {
                 MY_TYPE *p = static_cast<MY_TYPE *>(userdata);
-                auto &s = p->m_input_stream.istream();
-
-                auto cur = s.tellg();
-                s.seekg(0, std::ios_base::end);
-                auto end = s.tellg();
-                s.seekg(cur);
-
-                auto actual_size = std::min(static_cast<size_t>(end - cur), size * nitems);
-                s.read(buffer, actual_size);
+                if (!p->m_input_source) {
+                    return 0;
+                }
+                ssize_t actual_size = p->m_input_source->read(buffer, size * nitems, p->m_input_offset);
+                if (actual_size < 0) {
+                    return CURL_READFUNC_ABORT;
+                }
+                p->m_input_offset += actual_size;
                 return actual_size;
             }
 
@@ -211,17 +292,35 @@ namespace microsoft_azure {
         public:
             CurlEasyClient(int size) : m_size(size) {
                 curl_global_init(CURL_GLOBAL_DEFAULT);
+                memset(&m_stats, 0, sizeof(m_stats));
+
+                // Every handle uses the same DNS cache, TLS session cache and (with libcurl 7.57 or later) connection cache, so that a handle that
+                // hasn't been used for a while can reuse a connection or TLS session that another one made, rather than making a new one.
+                m_share = curl_share_init();
+                curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, lock_share);
+                curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+                curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+                curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+                curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
                 for (int i = 0; i < m_size; i++) {
                     CURL *h = curl_easy_init();
                     m_handles.push(h);
                 }
+                m_engine = std::make_shared<CurlMultiEngine>();
+                m_engine->start();
             }
 
             ~CurlEasyClient() {
+                m_engine->stop();
                 while (!m_handles.empty()) {
                     curl_easy_cleanup(m_handles.front());
                     m_handles.pop();
                 }
+                curl_share_cleanup(m_share);
                 curl_global_cleanup();
             }
 
@@ -230,6 +329,23 @@ namespace microsoft_azure {
                 return m_size;
             }
 
+            CurlMultiEngine &engine()
+            {
+                return *m_engine;
+            }
+
+            CURLSH *share()
+            {
+                return m_share;
+            }
+
+            curl_connection_stats connection_stats() {
+                std::lock_guard<std::mutex> lg(m_stats_mutex);
+                return m_stats;
+            }
+
+            AZURE_STORAGE_API void record_transfer(CURL *h);
+
             std::shared_ptr<CurlEasyRequest> get_handle() {
                 std::unique_lock<std::mutex> lk(m_handles_mutex);
                 m_cv.wait(lk, [this]() { return !m_handles.empty(); });
@@ -245,7 +361,20 @@ namespace microsoft_azure {
             }
 
         private:
+            static void lock_share(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+                static_cast<CurlEasyClient *>(userptr)->m_share_mutexes[data].lock();
+            }
+
+            static void unlock_share(CURL *, curl_lock_data data, void *userptr) {
+                static_cast<CurlEasyClient *>(userptr)->m_share_mutexes[data].unlock();
+            }
+
             int m_size;
+            CURLSH *m_share;
+            std::mutex m_share_mutexes[CURL_LOCK_DATA_LAST];
+            std::mutex m_stats_mutex;
+            curl_connection_stats m_stats;
+            std::shared_ptr<CurlMultiEngine> m_engine;
             std::queue<CURL *> m_handles;
             std::mutex m_handles_mutex;
             std::condition_variable m_cv;
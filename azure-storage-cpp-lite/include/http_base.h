@@ -6,6 +6,8 @@
 #include <map>
 
 #include "storage_stream.h"
+#include "storage_input_source.h"
+#include "storage_output_sink.h"
 
 namespace microsoft_azure {
     namespace storage {
@@ -45,8 +47,14 @@ namespace microsoft_azure {
 
             virtual void set_input_stream(storage_istream s) = 0;
 
+            // Sets the body of the request to be read directly from the source, rather than through a stream.
+            virtual void set_input_source(std::shared_ptr<storage_input_source> s) = 0;
+
             virtual void set_output_stream(storage_ostream s) = 0;
 
+            // Sets the body of the response to be written directly to the sink, rather than through a stream.
+            virtual void set_output_sink(std::shared_ptr<storage_output_sink> s) = 0;
+
             virtual void set_error_stream(std::function<bool(http_code)> f, storage_iostream s) = 0;
 
             virtual storage_istream get_input_stream() const = 0;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <memory>
+
+#include "storage_EXPORTS.h"
+#include "storage_stream.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        // The body of a request, which the HTTP client reads directly from.  Reads are positional, so that the body can be sent again from the start when the request is retried.
+        class storage_input_source {
+        public:
+            virtual ~storage_input_source() {}
+
+            // The length of the body, in bytes.
+            virtual unsigned long long size() const = 0;
+
+            // Copies up to length bytes of the body, starting at offset, to buffer.  Returns the number of bytes copied, or -1 on failure.
+            virtual ssize_t read(char *buffer, size_t length, unsigned long long offset) = 0;
+        };
+
+        // A body in memory.  The memory is not copied, so it must outlive the request.
+        class storage_buffer_source : public storage_input_source {
+        public:
+            storage_buffer_source(const char *data, size_t length)
+                : m_data(data),
+                m_length(length) {}
+
+            unsigned long long size() const override {
+                return m_length;
+            }
+
+            AZURE_STORAGE_API ssize_t read(char *buffer, size_t length, unsigned long long offset) override;
+
+        private:
+            const char *m_data;
+            size_t m_length;
+        };
+
+        // A range of a file, read with pread.  The file descriptor is not owned, so it must stay open until the request completes.
+        class storage_fd_source : public storage_input_source {
+        public:
+            storage_fd_source(int fd, unsigned long long offset, unsigned long long length)
+                : m_fd(fd),
+                m_offset(offset),
+                m_length(length) {}
+
+            unsigned long long size() const override {
+                return m_length;
+            }
+
+            AZURE_STORAGE_API ssize_t read(char *buffer, size_t length, unsigned long long offset) override;
+
+        private:
+            int m_fd;
+            unsigned long long m_offset;
+            unsigned long long m_length;
+        };
+
+        // A range of a file, mapped into memory for as long as the source exists.  Check valid() after construction; mapping can fail.
+        class storage_mmap_source : public storage_input_source {
+        public:
+            AZURE_STORAGE_API storage_mmap_source(int fd, unsigned long long offset, unsigned long long length);
+            AZURE_STORAGE_API ~storage_mmap_source();
+
+            storage_mmap_source(const storage_mmap_source &) = delete;
+            storage_mmap_source &operator=(const storage_mmap_source &) = delete;
+
+            bool valid() const {
+                return (m_length == 0) || (m_mapping != nullptr);
+            }
+
+            unsigned long long size() const override {
+                return m_length;
+            }
+
+            AZURE_STORAGE_API ssize_t read(char *buffer, size_t length, unsigned long long offset) override;
+
+        private:
+            void *m_mapping;
+            size_t m_mapping_length;
+            const char *m_data;
+            unsigned long long m_length;
+        };
+
+        // Adapts an istream to a source, for the stream-based APIs.  The remaining length of the stream is found once, when the source is created,
+        // and the stream is only repositioned if a read doesn't follow on from the previous one (that is, on retry.)
+        class storage_stream_source : public storage_input_source {
+        public:
+            AZURE_STORAGE_API storage_stream_source(storage_istream stream);
+
+            unsigned long long size() const override {
+                return m_length;
+            }
+
+            AZURE_STORAGE_API ssize_t read(char *buffer, size_t length, unsigned long long offset) override;
+
+            storage_istream stream() const {
+                return m_stream;
+            }
+
+        private:
+            storage_istream m_stream;
+            std::streampos m_start;
+            unsigned long long m_position;
+            unsigned long long m_length;
+        };
+
+    }
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <utility>
 
 #include "storage_EXPORTS.h"
 
@@ -28,6 +29,12 @@ namespace microsoft_azure {
                 : m_success(false),
                 m_error(std::move(error)) {}
 
+            // Responses can be large (a page of a listing has thousands of items), so an outcome is moved from the parser to the caller, never copied.
+            storage_outcome(storage_outcome &&) = default;
+            storage_outcome &operator=(storage_outcome &&) = default;
+            storage_outcome(const storage_outcome &) = delete;
+            storage_outcome &operator=(const storage_outcome &) = delete;
+
             bool success() const {
                 return m_success;
             }
@@ -40,6 +47,11 @@ namespace microsoft_azure {
                 return m_response;
             }
 
+            // Moves the response out of the outcome, leaving it empty.
+            RESPONSE_TYPE release_response() {
+                return std::move(m_response);
+            }
+
         private:
             bool m_success;
             storage_error m_error;
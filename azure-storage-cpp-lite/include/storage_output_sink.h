@@ -0,0 +1,95 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <memory>
+
+#include "storage_EXPORTS.h"
+#include "storage_stream.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        // The destination of the body of a response, which the HTTP client writes directly to.  Writes are positional, so that the body can be
+        // received again from the start when the request is retried.
+        class storage_output_sink {
+        public:
+            storage_output_sink()
+                : m_size(0) {}
+
+            virtual ~storage_output_sink() {}
+
+            // Writes length bytes of the body, at offset from its start.  Returns the number of bytes written, or -1 on failure.
+            ssize_t write(const char *data, size_t length, unsigned long long offset) {
+                ssize_t res = write_at(data, length, offset);
+                if (res > 0 && offset + res > m_size) {
+                    m_size = offset + res;
+                }
+                return res;
+            }
+
+            // The number of bytes of the body received.
+            unsigned long long size() const {
+                return m_size;
+            }
+
+        protected:
+            virtual ssize_t write_at(const char *data, size_t length, unsigned long long offset) = 0;
+
+        private:
+            unsigned long long m_size;
+        };
+
+        // Writes the body into caller-owned memory.  A body longer than the buffer fails the request.
+        class storage_buffer_sink : public storage_output_sink {
+        public:
+            storage_buffer_sink(char *buffer, size_t capacity)
+                : m_buffer(buffer),
+                m_capacity(capacity) {}
+
+        protected:
+            AZURE_STORAGE_API ssize_t write_at(const char *data, size_t length, unsigned long long offset) override;
+
+        private:
+            char *m_buffer;
+            size_t m_capacity;
+        };
+
+        // Writes the body into a range of a file with pwrite.  The file descriptor is not owned, so it must stay open until the request completes.
+        // A body longer than the range fails the request.
+        class storage_fd_sink : public storage_output_sink {
+        public:
+            storage_fd_sink(int fd, unsigned long long offset, unsigned long long capacity)
+                : m_fd(fd),
+                m_offset(offset),
+                m_capacity(capacity) {}
+
+        protected:
+            AZURE_STORAGE_API ssize_t write_at(const char *data, size_t length, unsigned long long offset) override;
+
+        private:
+            int m_fd;
+            unsigned long long m_offset;
+            unsigned long long m_capacity;
+        };
+
+        // Adapts an ostream to a sink, for the stream-based APIs.  The stream is only repositioned if a write doesn't follow on from the previous one (that is, on retry.)
+        class storage_stream_sink : public storage_output_sink {
+        public:
+            AZURE_STORAGE_API storage_stream_sink(storage_ostream stream);
+
+            storage_ostream stream() const {
+                return m_stream;
+            }
+
+        protected:
+            AZURE_STORAGE_API ssize_t write_at(const char *data, size_t length, unsigned long long offset) override;
+
+        private:
+            storage_ostream m_stream;
+            std::streampos m_start;
+            unsigned long long m_position;
+        };
+
+    }
+}
@@ -20,8 +20,9 @@ namespace microsoft_azure {
                 return m_domain;
             }
 
+            // The segment is percent-encoded (other than any '/' in it), so that it can hold any name.
             storage_url &append_path(const std::string &segment) {
-                m_path.append("/").append(segment);
+                m_path.append("/").append(encode(segment, true));
                 return *this;
             }
 
@@ -29,6 +30,7 @@ namespace microsoft_azure {
                 return m_path;
             }
 
+            // The value is kept as it is, for signing the request, and percent-encoded in to_string().
             storage_url &add_query(const std::string &name, const std::string &value) {
                 m_query[name].insert(value);
                 return *this;
@@ -40,6 +42,9 @@ namespace microsoft_azure {
 
             AZURE_STORAGE_API std::string to_string() const;
 
+            // Percent-encodes every byte of value other than the unreserved characters of RFC 3986 (and '/', if keep_slash is set.)
+            AZURE_STORAGE_API static std::string encode(const std::string &value, bool keep_slash);
+
         private:
             std::string m_domain;
             std::string m_path;
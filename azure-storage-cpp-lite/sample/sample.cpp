@@ -1,5 +1,6 @@
 
 #include <string>
+#include <sstream>
 #include <chrono>
 #include <thread>
 #include <assert.h>
@@ -69,7 +70,7 @@ int main()
     std::cout <<"Size of BLob: " << blobProperty.size << std::endl;
 
     auto blobs = bc.list_blobs_hierarchical(containerName, "/", "", "");
-    std::cout <<"Size of BLobs: " << blobs.size() << std::endl;
+    std::cout <<"Size of BLobs: " << blobs.blobs.size() << std::endl;
     std::cout <<"Error Size of BLobs: " << errno << std::endl;
     assert(errno == 0);
 
@@ -85,6 +86,68 @@ int main()
     assert(errno == 0);
     assert(exists);
 
+    // Block IDs are Base64, so they can contain '+', '/' and '=', which must be escaped in the URL.
+    std::string blockBlobName = "blocks.txt";
+    std::vector<put_block_list_request_base::block_item> blockList;
+    const char *blockIds[] = { "+/+/", "ab==", "c/d=" };
+    for (int i = 0; i < 3; i++)
+    {
+        std::istringstream blockData(std::string(1, 'a' + i));
+        bc.upload_block_from_stream(containerName, blockBlobName, blockIds[i], blockData);
+        assert(errno == 0);
+        put_block_list_request_base::block_item block;
+        block.id = blockIds[i];
+        block.type = put_block_list_request_base::block_type::uncommitted;
+        blockList.push_back(block);
+    }
+    bc.put_block_list(containerName, blockBlobName, blockList);
+    assert(errno == 0);
+    std::ostringstream blockBlobData;
+    bc.download_blob_to_stream(containerName, blockBlobName, 0, 0, blockBlobData);
+    assert(errno == 0);
+    assert(blockBlobData.str() == "abc");
+    auto blocks = bc.get_block_list(containerName, blockBlobName);
+    assert(errno == 0);
+    assert(blocks.committed.size() == 3);
+    assert(blocks.committed[0].name == "+/+/");
+    bc.delete_blob(containerName, blockBlobName);
+    assert(errno == 0);
+
+    // Names with characters that have a meaning in URLs are escaped, both in the path and in the copy source.
+    const char *oddNames[] = { "with space.txt", "per%cent.txt", "hash#tag.txt", "question?mark.txt" };
+    for (int i = 0; i < 4; i++)
+    {
+        std::string oddName = std::string("odd/") + oddNames[i];
+        std::string oddCopyName = oddName + ".copy";
+        std::istringstream oddData(oddName);
+        bc.upload_block_blob_from_stream(containerName, oddName, oddData);
+        assert(errno == 0);
+        std::ostringstream oddDownload;
+        bc.download_blob_to_stream(containerName, oddName, 0, 0, oddDownload);
+        assert(errno == 0);
+        assert(oddDownload.str() == oddName);
+
+        bc.start_copy(containerName, oddName, containerName, oddCopyName);
+        assert(errno == 0);
+        exists = bc.blob_exists(containerName, oddCopyName);
+        assert(errno == 0);
+        assert(exists);
+
+        auto oddList = bc.list_blobs_hierarchical(containerName, "/", "", oddName);
+        assert(errno == 0);
+        assert(oddList.blobs.size() == 2);
+        assert(oddList.blobs[0].name == oddName);
+        assert(oddList.blobs[1].name == oddCopyName);
+
+        bc.delete_blob(containerName, oddName);
+        assert(errno == 0);
+        bc.delete_blob(containerName, oddCopyName);
+        assert(errno == 0);
+        exists = bc.blob_exists(containerName, oddName);
+        assert(errno == 0);
+        assert(!exists);
+    }
+
     bc.delete_blob(containerName, blobName);
     bc.delete_blob(destContainerName, destBlobName);
     assert(errno == 0);
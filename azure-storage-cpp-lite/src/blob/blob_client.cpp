@@ -26,10 +26,27 @@
 namespace microsoft_azure {
 namespace storage {
 
+// Once the request completes, reads the ETag of the blob's new version from the response headers.
+static std::future<storage_outcome<std::string>> with_etag(std::shared_ptr<CurlEasyRequest> http, std::future<storage_outcome<void>> task) {
+    return std::async(std::launch::deferred, [](std::shared_ptr<CurlEasyRequest> http, std::future<storage_outcome<void>> task) {
+        auto result = task.get();
+        if (!result.success())
+        {
+            return storage_outcome<std::string>(result.error());
+        }
+        return storage_outcome<std::string>(http->get_header(constants::header_etag));
+    }, std::move(http), std::move(task));
+}
+
 std::future<storage_outcome<void>> blob_client::download_blob_to_stream(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os) {
+    return download_blob_to_sink(container, blob, offset, size, std::make_shared<storage_stream_sink>(storage_ostream(os)));
+}
+
+std::future<storage_outcome<void>> blob_client::download_blob_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::shared_ptr<storage_output_sink> sink, const std::string &if_match) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<download_blob_request>(container, blob);
+    request->set_if_match(if_match);
 
     if (size > 0) {
         request->set_start_byte(offset);
@@ -39,30 +56,30 @@ std::future<storage_outcome<void>> blob_client::download_blob_to_stream(const st
         request->set_start_byte(offset);
     }
 
-    http->set_output_stream(storage_ostream(os));
+    http->set_output_sink(sink);
 
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
 
-std::future<storage_outcome<void>> blob_client::upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata) {
+std::future<storage_outcome<std::string>> blob_client::upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata) {
+    return upload_block_blob_from_source(container, blob, std::make_shared<storage_stream_source>(storage_istream(is)), metadata);
+}
+
+std::future<storage_outcome<std::string>> blob_client::upload_block_blob_from_source(const std::string &container, const std::string &blob, std::shared_ptr<storage_input_source> source, const std::vector<std::pair<std::string, std::string>> &metadata) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<create_block_blob_request>(container, blob);
 
-    auto cur = is.tellg();
-    is.seekg(0, std::ios_base::end);
-    auto end = is.tellg();
-    is.seekg(cur);
     //check < 2^32
-    request->set_content_length(static_cast<unsigned int>(end - cur));
+    request->set_content_length(static_cast<unsigned int>(source->size()));
     if (metadata.size() > 0)
     {
         request->set_metadata(metadata);
     }
 
-    http->set_input_stream(storage_istream(is));
+    http->set_input_source(source);
 
-    return async_executor<void>::submit(m_account, request, http, m_context);
+    return with_etag(http, async_executor<void>::submit(m_account, request, http, m_context));
 }
 
 std::future<storage_outcome<void>> blob_client::delete_blob(const std::string &container, const std::string &blob, bool delete_snapshots) {
@@ -113,7 +130,7 @@ storage_outcome<container_property> blob_client::get_container_property(const st
     {
         containerProperty.set_valid(false);
     }
-    return storage_outcome<container_property>(containerProperty);
+    return storage_outcome<container_property>(std::move(containerProperty));
 }
 
 /*AZURE_STORAGE_API std::vector<list_containers_item> blob_client::list_containers(const std::string &prefix, bool include_metadata) {
@@ -137,29 +154,31 @@ storage_outcome<container_property> blob_client::get_container_property(const st
     return results;
 }*/
 
-std::future<storage_outcome<list_containers_response>> blob_client::list_containers(const std::string &prefix, bool include_metadata) {
+std::future<storage_outcome<list_containers_response>> blob_client::list_containers(const std::string &prefix, bool include_metadata, int max_results) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<list_containers_request>(prefix, include_metadata);
-    request->set_maxresults(2);
+    request->set_maxresults(max_results);
 
     return async_executor<list_containers_response>::submit(m_account, request, http, m_context);
 }
 
-std::future<storage_outcome<list_blobs_response>> blob_client::list_blobs(const std::string &container, const std::string &prefix) {
+std::future<storage_outcome<list_blobs_response>> blob_client::list_blobs(const std::string &container, const std::string &prefix, int max_results, list_blobs_request_base::include includes) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<list_blobs_request>(container, prefix);
-    request->set_maxresults(2);
+    request->set_maxresults(max_results);
+    request->set_includes(includes);
 
     return async_executor<list_blobs_response>::submit(m_account, request, http, m_context);
 }
 
-std::future<storage_outcome<list_blobs_hierarchical_response>> blob_client::list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix) {
+std::future<storage_outcome<list_blobs_hierarchical_response>> blob_client::list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int max_results, list_blobs_hierarchical_request_base::include includes) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<list_blobs_hierarchical_request>(container, delimiter, continuation_token, prefix);
-    request->set_maxresults(10000);
+    request->set_maxresults(max_results);
+    request->set_includes(includes);
 
     return async_executor<list_blobs_hierarchical_response>::submit(m_account, request, http, m_context);
 }
@@ -209,28 +228,27 @@ storage_outcome<blob_property> blob_client::get_blob_property(const std::string
     {
         blobProperty.set_valid(false);
     }
-    return storage_outcome<blob_property>(blobProperty);
+    return storage_outcome<blob_property>(std::move(blobProperty));
 }
 
 std::future<storage_outcome<void>> blob_client::upload_block_from_stream(const std::string &container, const std::string &blob, const std::string &blockid, std::istream &is) {
+    return upload_block_from_source(container, blob, blockid, std::make_shared<storage_stream_source>(storage_istream(is)));
+}
+
+std::future<storage_outcome<void>> blob_client::upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, std::shared_ptr<storage_input_source> source) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<put_block_request>(container, blob, blockid);
 
-    auto cur = is.tellg();
-    is.seekg(0, std::ios_base::end);
-    auto end = is.tellg();
-    is.seekg(cur);
     //check < 2^32
-    //std::cout<<"content length: " << end-cur<<std::endl;
-    request->set_content_length(static_cast<unsigned int>(end - cur));
+    request->set_content_length(static_cast<unsigned int>(source->size()));
 
-    http->set_input_stream(storage_istream(is));
+    http->set_input_source(source);
 
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
 
-std::future<storage_outcome<void>> blob_client::put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata) {
+std::future<storage_outcome<std::string>> blob_client::put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata, const std::string &if_match) {
     auto http = m_client->get_handle();
 
     auto request = std::make_shared<put_block_list_request>(container, blob);
@@ -239,8 +257,9 @@ std::future<storage_outcome<void>> blob_client::put_block_list(const std::string
     {
         request->set_metadata(metadata);
     }
+    request->set_if_match(if_match);
 
-    return async_executor<void>::submit(m_account, request, http, m_context);
+    return with_etag(http, async_executor<void>::submit(m_account, request, http, m_context));
 }
 
 std::future<storage_outcome<void>> blob_client::create_append_blob(const std::string &container, const std::string &blob) {
@@ -256,14 +275,11 @@ std::future<storage_outcome<void>> blob_client::append_block_from_stream(const s
 
     auto request = std::make_shared<append_block_request>(container, blob);
 
-    auto cur = is.tellg();
-    is.seekg(0, std::ios_base::end);
-    auto end = is.tellg();
-    is.seekg(cur);
+    auto source = std::make_shared<storage_stream_source>(storage_istream(is));
     //check < 2^32
-    request->set_content_length(static_cast<unsigned int>(end - cur));
+    request->set_content_length(static_cast<unsigned int>(source->size()));
 
-    http->set_input_stream(storage_istream(is));
+    http->set_input_source(source);
 
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
@@ -289,15 +305,12 @@ std::future<storage_outcome<void>> blob_client::put_page_from_stream(const std::
         request->set_start_byte(offset);
     }
 
-    auto cur = is.tellg();
-    is.seekg(0, std::ios_base::end);
-    auto end = is.tellg();
-    is.seekg(cur);
-    auto stream_size = static_cast<unsigned int>(end - cur);
+    auto source = std::make_shared<storage_stream_source>(storage_istream(is));
+    auto stream_size = static_cast<unsigned int>(source->size());
     // check stream_size == size || size == 0
     request->set_content_length(stream_size);
 
-    http->set_input_stream(storage_istream(is));
+    http->set_input_source(source);
 
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
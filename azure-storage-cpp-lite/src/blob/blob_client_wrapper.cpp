@@ -2,6 +2,10 @@
 * No exceptions will throw.
 */
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <fstream>
 
@@ -43,12 +47,17 @@ namespace microsoft_azure {
                 std::lock_guard<std::mutex> lg(m_buffers_mutex);
                 m_buffers.push(buffer);
             }
+            static size_t block_size()
+            {
+                return s_block_size;
+            }
         private:
             std::queue<char*> m_buffers;
             std::mutex m_buffers_mutex;
             static const size_t s_block_size = 4*1024*1024;
         };
         static mempool mpool;
+
         off_t get_file_size(const char* path);
 
         static const char* _base64_enctbl = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -226,7 +235,7 @@ namespace microsoft_azure {
 
             try
             {
-                auto containerProperty = m_blobClient->get_container_property(container).response();
+                auto containerProperty = m_blobClient->get_container_property(container).release_response();
 
                 if(containerProperty.valid())
                 {
@@ -246,7 +255,7 @@ namespace microsoft_azure {
             }
         }
 
-        std::vector<list_containers_item> blob_client_wrapper::list_containers(const std::string &prefix, bool include_metadata)
+        std::vector<list_containers_item> blob_client_wrapper::list_containers(const std::string &prefix, bool include_metadata, int max_results)
         {
             if(!is_valid())
             {
@@ -261,7 +270,7 @@ namespace microsoft_azure {
 
             try
             {
-                auto task = m_blobClient->list_containers(prefix, include_metadata);
+                auto task = m_blobClient->list_containers(prefix, include_metadata, max_results);
                 task.wait();
                 auto result = task.get();
 
@@ -270,7 +279,7 @@ namespace microsoft_azure {
                     errno = std::stoi(result.error().code);
                     return std::vector<list_containers_item>();
                 }
-                return result.response().containers;
+                return result.release_response().containers;
             }
             catch(std::exception ex)
             {
@@ -279,7 +288,7 @@ namespace microsoft_azure {
             }
         }
 
-        list_blobs_hierarchical_response blob_client_wrapper::list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix)
+        list_blobs_hierarchical_response blob_client_wrapper::list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int max_results, list_blobs_hierarchical_request_base::include includes)
         {
             if(!is_valid())
             {
@@ -294,7 +303,7 @@ namespace microsoft_azure {
 
             try
             {
-                auto task = m_blobClient->list_blobs_hierarchical(container, delimiter, continuation_token, prefix);
+                auto task = m_blobClient->list_blobs_hierarchical(container, delimiter, continuation_token, prefix, max_results, includes);
                 task.wait();
                 auto result = task.get();
 
@@ -308,7 +317,7 @@ namespace microsoft_azure {
                 else
                 {
                     errno = 0;
-                    return result.response();
+                    return result.release_response();
                 }
             }
             catch(std::exception ex)
@@ -318,34 +327,75 @@ namespace microsoft_azure {
             }
         }
 
-        void blob_client_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
+        std::string blob_client_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return std::string();
             }
             if(sourcePath.length() == 0 || container.length() == 0 || blob.length() == 0)
             {
                 errno = invalid_parameters;
-                return;
+                return std::string();
+            }
+
+            int fd = open(sourcePath.c_str(), O_RDONLY);
+            if(fd == -1)
+            {
+                /*errno already set by open.*/
+                return std::string();
+            }
+            struct stat st;
+            if(fstat(fd, &st) != 0)
+            {
+                int error = errno;
+                close(fd);
+                errno = error;
+                return std::string();
             }
 
-            std::ifstream ifs;
+            std::string etag;
             try
             {
-                ifs.open(sourcePath, std::ifstream::in);
+                auto task = m_blobClient->upload_block_blob_from_source(container, blob, std::make_shared<storage_fd_source>(fd, 0, st.st_size), metadata);
+                task.wait();
+                auto result = task.get();
+                if(!result.success())
+                {
+                    errno = std::stoi(result.error().code);
+                }
+                else
+                {
+                    etag = result.release_response();
+                    errno = 0;
+                }
             }
             catch(std::exception ex)
             {
-                // TODO open failed
                 errno = unknown_error;
+            }
+
+            close(fd);
+            return etag;
+        }
+
+        void blob_client_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return;
+            }
+            if(container.length() == 0 || blob.length() == 0)
+            {
+                errno = invalid_parameters;
                 return;
             }
 
             try
             {
-                auto task = m_blobClient->upload_block_blob_from_stream(container, blob, ifs, metadata);
+                auto task = m_blobClient->upload_block_blob_from_stream(container, blob, is, metadata);
                 task.wait();
                 auto result = task.get();
                 if(!result.success())
@@ -361,26 +411,47 @@ namespace microsoft_azure {
             {
                 errno = unknown_error;
             }
+        }
+
+        void blob_client_wrapper::upload_block_from_stream(const std::string &container, const std::string blob, const std::string &blockid, std::istream &is)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return;
+            }
+            if(container.length() == 0 || blob.length() == 0 || blockid.length() == 0)
+            {
+                errno = invalid_parameters;
+                return;
+            }
 
             try
             {
-                ifs.close();
+                auto result = m_blobClient->upload_block_from_stream(container, blob, blockid, is).get();
+                if(!result.success())
+                {
+                    errno = std::stoi(result.error().code);
+                }
+                else
+                {
+                    errno = 0;
+                }
             }
-            catch(std::exception ex)
+            catch(std::exception &ex)
             {
-                // TODO close failed
                 errno = unknown_error;
             }
         }
 
-        void blob_client_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
+        void blob_client_wrapper::upload_block_from_source(const std::string &container, const std::string blob, const std::string &blockid, std::shared_ptr<storage_input_source> source)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
                 return;
             }
-            if(container.length() == 0 || blob.length() == 0)
+            if(container.length() == 0 || blob.length() == 0 || blockid.length() == 0 || !source)
             {
                 errno = invalid_parameters;
                 return;
@@ -388,9 +459,7 @@ namespace microsoft_azure {
 
             try
             {
-                auto task = m_blobClient->upload_block_blob_from_stream(container, blob, is, metadata);
-                task.wait();
-                auto result = task.get();
+                auto result = m_blobClient->upload_block_from_source(container, blob, blockid, source).get();
                 if(!result.success())
                 {
                     errno = std::stoi(result.error().code);
@@ -400,35 +469,97 @@ namespace microsoft_azure {
                     errno = 0;
                 }
             }
-            catch(std::exception ex)
+            catch(std::exception &ex)
             {
                 errno = unknown_error;
             }
         }
 
-        void blob_client_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
+        std::string blob_client_wrapper::put_block_list(const std::string &container, const std::string blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata, const std::string &if_match)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return std::string();
+            }
+            if(container.length() == 0 || blob.length() == 0)
+            {
+                errno = invalid_parameters;
+                return std::string();
+            }
+
+            try
+            {
+                auto result = m_blobClient->put_block_list(container, blob, block_list, metadata, if_match).get();
+                if(!result.success())
+                {
+                    errno = std::stoi(result.error().code);
+                    return std::string();
+                }
+                errno = 0;
+                return result.release_response();
+            }
+            catch(std::exception &ex)
+            {
+                errno = unknown_error;
+                return std::string();
+            }
+        }
+
+        get_block_list_response blob_client_wrapper::get_block_list(const std::string &container, const std::string &blob)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return get_block_list_response();
+            }
+            if(container.length() == 0 || blob.length() == 0)
+            {
+                errno = invalid_parameters;
+                return get_block_list_response();
+            }
+
+            try
+            {
+                auto result = m_blobClient->get_block_list(container, blob).get();
+                if(!result.success())
+                {
+                    errno = std::stoi(result.error().code);
+                    return get_block_list_response();
+                }
+                errno = 0;
+                return result.release_response();
+            }
+            catch(std::exception &ex)
+            {
+                errno = unknown_error;
+                return get_block_list_response();
+            }
+        }
+
+        std::string blob_client_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return std::string();
             }
             if(sourcePath.length() == 0 || container.length() == 0 || blob.length() == 0)
             {
                 errno = invalid_parameters;
-                return;
+                return std::string();
             }
 
             off_t fileSize = get_file_size(sourcePath.c_str());
             if(fileSize < 0)
             {
                 /*errno already set by stat.*/
-                return;
+                return std::string();
             }
 
             if(fileSize <= 64*1024*1024)
             {
-                put_blob(sourcePath, container, blob, metadata);
+                return put_blob(sourcePath, container, blob, metadata);
             }
             else
             {
@@ -444,35 +575,39 @@ namespace microsoft_azure {
                     block_size = fileSize; 
                 }
 
-                std::ifstream ifs;
-                try
+                int fd = open(sourcePath.c_str(), O_RDONLY);
+                if(fd == -1)
                 {
-                    ifs.open(sourcePath, std::ifstream::in);
-                }
-                catch(std::exception ex)
-                {
-                    // TODO open failed
-                    errno = unknown_error;
-                    return;
+                    /*errno already set by open.*/
+                    return std::string();
                 }
 
+                // The block uploads run on the client's event loop; up to parallel of them are in flight at once, each reading its range of the file directly.
+                struct block_upload
+                {
+                    std::future<storage_outcome<void>> task;
+                };
                 std::vector<put_block_list_request_base::block_item> block_list;
-                std::vector<std::future<void>> task_list;
-                std::mutex mutex;
-                std::condition_variable cv;
-                std::mutex cv_mutex;
-                //const size_t mParallel = parallel;
+                std::deque<block_upload> uploads;
+                size_t max_uploads = std::max<size_t>(std::min<size_t>(parallel, m_concurrency), 1);
+                errno = 0;
+                auto finish_upload = [&uploads]()
+                {
+                    auto blockResult = uploads.front().task.get();
+                    uploads.pop_front();
+                    if(!blockResult.success())
+                    {
+                        errno = std::stoi(blockResult.error().code);
+                    }
+                };
 
                 for(long long offset = 0, idx = 0; offset < fileSize; offset += block_size, ++idx)
                 {
-                        int length = block_size;
-                        if(offset + length > fileSize)
-                        {
-                            length = fileSize - offset;  
-                        }
-
-                        char* buffer = new char[block_size];
-                        ifs.read(buffer, length);
+                    int length = block_size;
+                    if(offset + length > fileSize)
+                    {
+                        length = fileSize - offset;
+                    }
 
                     std::string block_id = std::to_string(idx);
                     if(block_id.length() < 44)
@@ -485,68 +620,28 @@ namespace microsoft_azure {
                     block.type = put_block_list_request_base::block_type::uncommitted;
                     block_list.push_back(block);
 
+                    while(uploads.size() >= max_uploads && errno == 0)
                     {
-                        while(task_list.size() > m_concurrency)
-                        {
-                            for(auto iter = task_list.begin(); iter != task_list.end() && task_list.size() > m_concurrency; )
-                            {
-                                iter->wait();
-                                iter = task_list.erase(iter);
-                            }
-                        }
+                        finish_upload();
                     }
-
                     if(errno != 0)
                     {
-                        //std::cout << "errno: "<< errno<<std::endl;
                         break;
                     }
-                    auto single_put = std::async(std::launch::async, [block_id, block_size, idx, this, buffer, offset, length, &container, &blob, &parallel, &mutex, &cv_mutex, &cv](){
-                        {
-                            std::unique_lock<std::mutex> lk(cv_mutex);
-                            cv.wait(lk, [&parallel, &mutex]() {
-                                std::lock_guard<std::mutex> lock(mutex);
-                                if(parallel > 0)
-                                {
-                                    --parallel;
-                                    return true;
-                                }
-                                return false;
-                            });
-                            //std::cout << "idx: " << idx << std::endl;
-                            //std::cout << "parallel: " << parallel << std::endl;
-                        }
-
-                        std::istringstream in;
-                        in.rdbuf()->pubsetbuf(buffer, length);
-                        auto blockResult = m_blobClient->upload_block_from_stream(container, blob, block_id, in).get();
-                        delete[] buffer;
-                        if(!blockResult.success())
-                        {
-                            errno = std::stoi(blockResult.error().code);
-                        }
 
-                        {
-                            std::lock_guard<std::mutex> lock(mutex);
-                            ++parallel;
-                            //std::cout << "idx done: " << idx << std::endl;
-                            //std::cout << "parallel done: " << parallel << std::endl;
-                            cv.notify_one();
-                        }
-                    });
-                    //std::cout << "End: " << idx << std::endl;
-                    task_list.push_back(std::move(single_put));
+                    block_upload upload;
+                    upload.task = m_blobClient->upload_block_from_source(container, blob, block_id, std::make_shared<storage_fd_source>(fd, offset, length));
+                    uploads.push_back(std::move(upload));
                 }
 
-                for(size_t i = 0; i < task_list.size(); ++i)
-                //while(!task_list.empty())
+                // Wait for every upload, even after a failure, since they read from the file.
+                while(!uploads.empty())
                 {
-                    //task_list.front().wait();
-                    //task_list.pop();
-                    task_list[i].wait();
-                    if(errno != 0)
+                    int previous = errno;
+                    finish_upload();
+                    if(previous != 0)
                     {
-                        break;
+                        errno = previous;
                     }
                 }
 
@@ -554,6 +649,7 @@ namespace microsoft_azure {
                 //    std::unique_lock<std::mutex> lk(mutex);
                 //    cv.wait(lk, [&parallel]() { return parallel == 8; });
                 //}
+                std::string etag;
                 if(errno == 0)
                 {
                     auto result = m_blobClient->put_block_list(container, blob, block_list, metadata).get();
@@ -562,17 +658,14 @@ namespace microsoft_azure {
                         // TODO upload failed
                         errno = std::stoi(result.error().code);
                     }
+                    else
+                    {
+                        etag = result.release_response();
+                    }
                 }
 
-                try
-                {
-                    ifs.close();
-                }
-                catch(std::exception ex)
-                {
-                    // TODO close failed
-                    errno = unknown_error;
-                }
+                close(fd);
+                return etag;
             }
         }
 
@@ -616,118 +709,165 @@ namespace microsoft_azure {
             }
         }
 
-        void blob_client_wrapper::download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, size_t parallel)
+        unsigned long long blob_client_wrapper::download_blob_to_fd(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, int fd, unsigned long long fd_offset, const std::string &if_match)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return 0;
+            }
+            if(container.length() == 0 || blob.length() == 0 || size == 0 || fd < 0)
+            {
+                errno = invalid_parameters;
+                return 0;
             }
 
+            return download_blob_to_sink(container, blob, offset, size, std::make_shared<storage_fd_sink>(fd, fd_offset, size), if_match);
+        }
+
+        unsigned long long blob_client_wrapper::download_blob_to_buffer(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, char *buffer)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return 0;
+            }
+            if(container.length() == 0 || blob.length() == 0 || size == 0 || buffer == NULL)
+            {
+                errno = invalid_parameters;
+                return 0;
+            }
+
+            return download_blob_to_sink(container, blob, offset, size, std::make_shared<storage_buffer_sink>(buffer, size));
+        }
 
+        unsigned long long blob_client_wrapper::download_blob_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::shared_ptr<storage_output_sink> sink, const std::string &if_match)
+        {
             try
             {
-                parallel = parallel;
-                //download_blob_to_stream(container, blob, 0, 0, ofs);
+                auto result = m_blobClient->download_blob_to_sink(container, blob, offset, size, sink, if_match).get();
+                if(!result.success())
+                {
+                    errno = std::stoi(result.error().code);
+                    return 0;
+                }
+                errno = 0;
+                return sink->size();
+            }
+            catch(std::exception &)
+            {
+                errno = unknown_error;
+                return 0;
+            }
+        }
 
-                std::mutex ofs_mutex;
-                std::condition_variable cv;
-                std::mutex cv_mutex;
-                std::condition_variable writeCV;
-                
+        void blob_client_wrapper::download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, size_t parallel)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return;
+            }
+
+            try
+            {
                 auto blobProperty = get_blob_property(container, blob);
-                auto length = blobProperty.size;
-                //std::cout << "Size: " << length << std::endl;
-                unsigned long long range = 4*1024*1024; 
-                std::vector<std::future<int>> task_list;
-                std::mutex mutex;
-                unsigned long long current = 0;
+                if(errno != 0)
+                {
+                    return;
+                }
+                unsigned long long length = blobProperty.size;
 
-                for(unsigned long long offset = 0; offset < length; offset += range)
+                int fd = open(destPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                if(fd == -1)
                 {
-                    if(offset + range > length)
-                    {
-                        range = length - offset;
-                    }
-                    
+                    /*errno already set by open.*/
+                    return;
+                }
+
+                // Reserve the space for the whole blob up-front, so that ranges can be written at their own offsets, in any order.
+                if(length > 0)
+                {
+                    int allocret = posix_fallocate(fd, 0, length);
+                    if(allocret != 0 && ftruncate(fd, length) != 0)
                     {
-                        while(task_list.size() > m_concurrency)
-                        {
-                            for(auto iter = task_list.begin(); iter != task_list.end() && task_list.size() > m_concurrency; )
-                            {
-                                iter->wait();
-                                iter = task_list.erase(iter);
-                            }
-                        }
+                        int error = errno;
+                        close(fd);
+                        errno = error;
+                        return;
                     }
-                    auto single_download = std::async(std::launch::async, [offset, range, this, &destPath, &current, &ofs_mutex, &mutex, &cv_mutex, &cv, &writeCV, &parallel, &container, &blob](){
-                        {
-                            std::unique_lock<std::mutex> lk(cv_mutex);
-                            cv.wait(lk, [&parallel, &mutex]() {
-                                std::lock_guard<std::mutex> lock(mutex);
-                                if(parallel > 0)
-                                {
-                                    --parallel;
-                                    //std::cout << "parallel: " << parallel << std::endl;
-                                    return true;
-                                }
-                                return false;
-                            });
-                        }
-                        char* buffer = new char[range];
-                        std::ostringstream os;
-                        os.rdbuf()->pubsetbuf(buffer, range);
+                }
+
+                const unsigned long long range = mempool::block_size();
+                const size_t range_count = (length + range - 1) / range;
+                std::vector<int> range_errors(range_count, 0);
+                std::atomic<size_t> next_range(0);
+                std::atomic<bool> failed(false);
 
-                        download_blob_to_stream(container, blob, offset, range, os);
+                // Each worker claims the next range, and downloads it straight into the file at its own offset.
+                auto worker = [this, fd, length, range, range_count, &range_errors, &next_range, &failed, &container, &blob]()
+                {
+                    size_t index;
+                    while(!failed.load() && (index = next_range++) < range_count)
+                    {
+                        unsigned long long offset = index * range;
+                        unsigned long long size = std::min(range, length - offset);
 
+                        auto sink = std::make_shared<storage_fd_sink>(fd, offset, size);
+                        int error = 0;
+                        try
                         {
-                            std::unique_lock<std::mutex> lk(ofs_mutex);
-                            writeCV.wait(lk, [&current, offset]() { 
-                                //std::cout << "offset: " << offset << std::endl;
-                                return current >= offset; });
-                            //if((unsigned long long)ofs.tellp() != offset)
-                            //{
-                            //    ofs.seekp(offset, std::ios_base::beg);
-                            //}
-                            std::ofstream ofs;
-                            if(offset == 0)
-                            {
-                                ofs.open(destPath, std::ofstream::out);
-                            }
-                            else
+                            auto result = m_blobClient->download_blob_to_sink(container, blob, offset, size, sink).get();
+                            if(!result.success())
                             {
-                                ofs.open(destPath, std::ofstream::out | std::ofstream::app);
+                                error = std::stoi(result.error().code);
                             }
-                            ofs.write(os.str().c_str(), range);
-                            ofs.close();
-                            delete[] buffer;
-
-                            if(offset + range > current)
+                            else if(sink->size() != size)
                             {
-                                current = offset + range;
+                                // The blob changed size on the service during the download.
+                                error = EIO;
                             }
-                            //std::cout << "current: " << current << std::endl;
-                            writeCV.notify_all();
+                        }
+                        catch(std::exception &)
+                        {
+                            error = unknown_error;
                         }
 
+                        if(error != 0)
                         {
-                            std::lock_guard<std::mutex> lock(mutex);
-                            ++parallel;
-                            //std::cout << "parallel done: " << parallel << std::endl;
-                            cv.notify_one();
+                            range_errors[index] = error;
+                            failed = true;
                         }
-                        return errno;
-                    });
-                    task_list.push_back(std::move(single_download));
+                    }
+                };
+
+                size_t worker_count = std::min(range_count, std::max<size_t>(std::min<size_t>(parallel, m_concurrency), 1));
+                std::vector<std::future<void>> workers;
+                for(size_t i = 1; i < worker_count; ++i)
+                {
+                    workers.push_back(std::async(std::launch::async, worker));
                 }
+                worker();
+                for(size_t i = 0; i < workers.size(); ++i)
+                {
+                    workers[i].wait();
+                }
+
+                int close_error = (close(fd) == 0) ? 0 : errno;
 
-                for(size_t i = 0; i < task_list.size(); ++i)
+                // Report the error from the first range that failed.
+                errno = 0;
+                for(size_t i = 0; i < range_count; ++i)
                 {
-                    task_list[i].wait();
+                    if(range_errors[i] != 0)
+                    {
+                        errno = range_errors[i];
+                        return;
+                    }
                 }
-                //std::cout << "End" << std::endl;
+                errno = close_error;
             }
-            catch(std::exception ex)
+            catch(std::exception &)
             {
                 errno = unknown_error;
                 return;
@@ -753,7 +893,7 @@ namespace microsoft_azure {
                 else
                 {
                     errno = 0;
-                    return result.response();
+                    return result.release_response();
                 }
             }
             catch(std::exception ex)
@@ -1,4 +1,6 @@
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "http/libcurl_http_client.h"
 
@@ -10,10 +12,15 @@ namespace microsoft_azure {
         CurlEasyRequest::CurlEasyRequest(std::shared_ptr<CurlEasyClient> client, CURL *h)
         : m_client(client),
             m_curl(h),
-            m_slist(NULL) {
+            m_slist(NULL),
+            m_input_offset(0),
+            m_output_offset(0) {
             //check_code(curl_easy_setopt(m_curl, CURLOPT_VERBOSE, 1));
             check_code(curl_easy_setopt(m_curl, CURLOPT_HEADERFUNCTION, header_callback));
             check_code(curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this));
+            // curl_easy_reset() clears these when the previous request on the handle is done, but not the caches they refer to.
+            check_code(curl_easy_setopt(m_curl, CURLOPT_SHARE, m_client->share()));
+            check_code(curl_easy_setopt(m_curl, CURLOPT_TCP_KEEPALIVE, 1L));
         }
 
         CurlEasyRequest::~CurlEasyRequest() {
@@ -25,6 +32,23 @@ namespace microsoft_azure {
         }
 
         http_base::http_code CurlEasyRequest::perform() {
+            prepare();
+            check_code(curl_easy_perform(m_curl));
+            record_transfer();
+
+            return m_code;
+        }
+
+        void CurlEasyRequest::submit(std::function<void(http_code, storage_istream)> cb, std::chrono::seconds interval) {
+            prepare();
+            m_client->engine().add(m_curl, interval, [this, cb](CURLcode code) {
+                check_code(code);
+                record_transfer();
+                cb(m_code, m_error_stream);
+            });
+        }
+
+        void CurlEasyRequest::prepare() {
             check_code(curl_easy_setopt(m_curl, CURLOPT_CUSTOMREQUEST, NULL));
             switch (m_method) {
             case http_method::get:
@@ -47,13 +71,42 @@ namespace microsoft_azure {
 
             check_code(curl_easy_setopt(m_curl, CURLOPT_URL, m_url.data()));
 
+            // Each attempt sends the body from the start, and receives the response body from the start.  A failed attempt switches the
+            // response body to the error stream, so switch it back.
+            m_input_offset = 0;
+            m_output_offset = 0;
+            if (m_output_sink) {
+                check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write));
+                check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
+            }
+
             m_slist = curl_slist_append(m_slist, "Transfer-Encoding:");
             m_slist = curl_slist_append(m_slist, "Expect:");
             check_code(curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_slist));
+        }
 
-            check_code(curl_easy_perform(m_curl));
+        void CurlEasyRequest::record_transfer() {
+            m_client->record_transfer(m_curl);
+        }
 
-            return m_code;
+        void CurlEasyClient::record_transfer(CURL *h) {
+            long connects = 0;
+            double connect_time = 0;
+            double app_connect_time = 0;
+            curl_easy_getinfo(h, CURLINFO_NUM_CONNECTS, &connects);
+            curl_easy_getinfo(h, CURLINFO_CONNECT_TIME, &connect_time);
+            curl_easy_getinfo(h, CURLINFO_APPCONNECT_TIME, &app_connect_time);
+
+            std::lock_guard<std::mutex> lg(m_stats_mutex);
+            m_stats.transfers++;
+            if (connects > 0) {
+                m_stats.new_connections++;
+                // The app connect time is when the TLS handshake finished (0 for plain HTTP), and the connect time is when it started.
+                if (app_connect_time > 0) {
+                    m_stats.tls_handshakes++;
+                    m_stats.tls_handshake_microseconds += static_cast<unsigned long long>((app_connect_time - connect_time) * 1000000);
+                }
+            }
         }
 
         size_t CurlEasyRequest::header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
@@ -72,10 +125,132 @@ namespace microsoft_azure {
                 }
             }
             else {
-                p->m_headers[header.substr(0, colon)] = header.substr(colon + 2);
+                // The value is everything after the colon, without the whitespace around it or the line ending.
+                auto start = header.find_first_not_of(" \t", colon + 1);
+                auto end = header.find_last_not_of(" \t\r\n");
+                p->m_headers[header.substr(0, colon)] = ((start == std::string::npos) || (end < start)) ? std::string() : header.substr(start, end - start + 1);
             }
             return size * nitems;
         }
 
+
+        CurlMultiEngine::CurlMultiEngine()
+            : m_multi(curl_multi_init()),
+            m_stop(false) {
+            if (pipe(m_wake_pipe) == 0) {
+                fcntl(m_wake_pipe[0], F_SETFL, O_NONBLOCK);
+                fcntl(m_wake_pipe[1], F_SETFL, O_NONBLOCK);
+            }
+            else {
+                m_wake_pipe[0] = m_wake_pipe[1] = -1;
+            }
+        }
+
+        CurlMultiEngine::~CurlMultiEngine() {
+            for (auto iter = m_running.begin(); iter != m_running.end(); ++iter) {
+                curl_multi_remove_handle(m_multi, iter->first);
+            }
+            curl_multi_cleanup(m_multi);
+            if (m_wake_pipe[0] != -1) {
+                close(m_wake_pipe[0]);
+                close(m_wake_pipe[1]);
+            }
+        }
+
+        void CurlMultiEngine::start() {
+            // The thread holds a reference to the engine, so that the engine outlives it even if the client is destroyed from a completion callback.
+            auto self = shared_from_this();
+            m_thread = std::thread([self]() { self->run(); });
+        }
+
+        void CurlMultiEngine::stop() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            wake();
+            if (m_thread.joinable()) {
+                if (m_thread.get_id() == std::this_thread::get_id()) {
+                    m_thread.detach();
+                }
+                else {
+                    m_thread.join();
+                }
+            }
+        }
+
+        void CurlMultiEngine::add(CURL *h, std::chrono::seconds delay, std::function<void(CURLcode)> done) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                transfer t;
+                t.handle = h;
+                t.done = std::move(done);
+                m_delayed.insert(std::make_pair(std::chrono::steady_clock::now() + delay, std::move(t)));
+            }
+            wake();
+        }
+
+        void CurlMultiEngine::wake() {
+            char c = 0;
+            if (write(m_wake_pipe[1], &c, 1) < 0) {
+                // The pipe is full, so the event loop is going to wake anyway.
+            }
+        }
+
+        void CurlMultiEngine::run() {
+            while (true) {
+                // Idle waits are bounded, in case the pipe couldn't be created.
+                int timeout_ms = 1000;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (m_stop) {
+                        break;
+                    }
+                    auto now = std::chrono::steady_clock::now();
+                    while (!m_delayed.empty() && (m_delayed.begin()->first <= now)) {
+                        transfer &t = m_delayed.begin()->second;
+                        m_running[t.handle] = std::move(t.done);
+                        curl_multi_add_handle(m_multi, t.handle);
+                        m_delayed.erase(m_delayed.begin());
+                    }
+                    if (!m_delayed.empty()) {
+                        auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(m_delayed.begin()->first - now).count() + 1;
+                        timeout_ms = std::min(timeout_ms, static_cast<int>(delay));
+                    }
+                }
+
+                int running = 0;
+                curl_multi_perform(m_multi, &running);
+
+                CURLMsg *message;
+                int remaining = 0;
+                while ((message = curl_multi_info_read(m_multi, &remaining)) != NULL) {
+                    if (message->msg != CURLMSG_DONE) {
+                        continue;
+                    }
+                    CURL *h = message->easy_handle;
+                    CURLcode result = message->data.result;
+                    curl_multi_remove_handle(m_multi, h);
+                    auto iter = m_running.find(h);
+                    if (iter == m_running.end()) {
+                        continue;
+                    }
+                    auto done = std::move(iter->second);
+                    m_running.erase(iter);
+                    // The callback may release the last reference to the request (and so return the handle to the pool), or submit it again.
+                    done(result);
+                }
+
+                struct curl_waitfd wake_fd;
+                wake_fd.fd = m_wake_pipe[0];
+                wake_fd.events = CURL_WAIT_POLLIN;
+                wake_fd.revents = 0;
+                curl_multi_wait(m_multi, &wake_fd, (m_wake_pipe[0] != -1) ? 1 : 0, timeout_ms, NULL);
+                char buffer[64];
+                while ((m_wake_pipe[0] != -1) && (read(m_wake_pipe[0], buffer, sizeof(buffer)) > 0)) {
+                }
+            }
+        }
+
     }
 }
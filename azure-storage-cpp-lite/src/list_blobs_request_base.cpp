@@ -20,7 +20,7 @@ void list_blobs_request_base::build_request(const storage_account &a, http_base
     add_optional_query(url, constants::query_delimiter, r.delimiter());
     add_optional_query(url, constants::query_marker, r.marker());
     add_optional_query(url, constants::query_maxresults, r.maxresults());
-    std::string include(",");
+    std::string include;
     if (r.includes() & list_blobs_request_base::include::snapshots) {
         include.append(",").append(constants::query_include_snapshots);
     }
@@ -33,7 +33,9 @@ void list_blobs_request_base::build_request(const storage_account &a, http_base
     if (r.includes() & list_blobs_request_base::include::copy) {
         include.append(",").append(constants::query_include_copy);
     }
-    add_optional_query(url, constants::query_include, include.substr(1));
+    if (!include.empty()) {
+        add_optional_query(url, constants::query_include, include.substr(1));
+    }
     add_optional_query(url, constants::query_timeout, r.timeout());
     h.set_url(url.to_string());
 
@@ -73,7 +75,7 @@ void list_blobs_hierarchical_request_base::build_request(const storage_account &
     {
         add_optional_query(url, constants::query_maxresults, r.maxresults());
     }
-    std::string include(",");
+    std::string include;
     if (r.includes() & list_blobs_request_base::include::snapshots) {
         include.append(",").append(constants::query_include_snapshots);
     }
@@ -86,7 +88,9 @@ void list_blobs_hierarchical_request_base::build_request(const storage_account &
     if (r.includes() & list_blobs_request_base::include::copy) {
         include.append(",").append(constants::query_include_copy);
     }
-    add_optional_query(url, constants::query_include, include.substr(1));
+    if (!include.empty()) {
+        add_optional_query(url, constants::query_include, include.substr(1));
+    }
     add_optional_query(url, constants::query_timeout, r.timeout());
     h.set_url(url.to_string());
 
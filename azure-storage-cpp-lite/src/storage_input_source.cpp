@@ -0,0 +1,114 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "storage_input_source.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        ssize_t storage_buffer_source::read(char *buffer, size_t length, unsigned long long offset) {
+            if (offset >= m_length) {
+                return 0;
+            }
+            size_t count = static_cast<size_t>(std::min<unsigned long long>(length, m_length - offset));
+            memcpy(buffer, m_data + offset, count);
+            return count;
+        }
+
+        ssize_t storage_fd_source::read(char *buffer, size_t length, unsigned long long offset) {
+            if (offset >= m_length) {
+                return 0;
+            }
+            size_t count = static_cast<size_t>(std::min<unsigned long long>(length, m_length - offset));
+            size_t done = 0;
+            while (done < count) {
+                ssize_t res = pread(m_fd, buffer + done, count - done, m_offset + offset + done);
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (res <= 0) {
+                    // The file is shorter than the range; a short body would only be rejected by the server.
+                    return -1;
+                }
+                done += res;
+            }
+            return done;
+        }
+
+        storage_mmap_source::storage_mmap_source(int fd, unsigned long long offset, unsigned long long length)
+            : m_mapping(nullptr),
+            m_mapping_length(0),
+            m_data(nullptr),
+            m_length(length) {
+            if (length == 0) {
+                return;
+            }
+
+            // The mapping has to start on a page boundary.
+            unsigned long long page_size = sysconf(_SC_PAGESIZE);
+            unsigned long long start = offset - (offset % page_size);
+            m_mapping_length = static_cast<size_t>(offset + length - start);
+            void *mapping = mmap(NULL, m_mapping_length, PROT_READ, MAP_SHARED, fd, start);
+            if (mapping == MAP_FAILED) {
+                m_mapping_length = 0;
+                return;
+            }
+            madvise(mapping, m_mapping_length, MADV_SEQUENTIAL);
+            m_mapping = mapping;
+            m_data = static_cast<const char *>(mapping) + (offset - start);
+        }
+
+        storage_mmap_source::~storage_mmap_source() {
+            if (m_mapping != nullptr) {
+                munmap(m_mapping, m_mapping_length);
+            }
+        }
+
+        ssize_t storage_mmap_source::read(char *buffer, size_t length, unsigned long long offset) {
+            if (m_data == nullptr) {
+                return (m_length == 0) ? 0 : -1;
+            }
+            if (offset >= m_length) {
+                return 0;
+            }
+            size_t count = static_cast<size_t>(std::min<unsigned long long>(length, m_length - offset));
+            memcpy(buffer, m_data + offset, count);
+            return count;
+        }
+
+        storage_stream_source::storage_stream_source(storage_istream stream)
+            : m_stream(stream),
+            m_position(0),
+            m_length(0) {
+            auto &s = m_stream.istream();
+            m_start = s.tellg();
+            s.seekg(0, std::ios_base::end);
+            auto end = s.tellg();
+            s.seekg(m_start);
+            if ((m_start != std::streampos(-1)) && (end > m_start)) {
+                m_length = static_cast<unsigned long long>(end - m_start);
+            }
+        }
+
+        ssize_t storage_stream_source::read(char *buffer, size_t length, unsigned long long offset) {
+            if (offset >= m_length) {
+                return 0;
+            }
+            auto &s = m_stream.istream();
+            if (offset != m_position) {
+                s.clear();
+                s.seekg(m_start + static_cast<std::streamoff>(offset));
+            }
+            size_t count = static_cast<size_t>(std::min<unsigned long long>(length, m_length - offset));
+            s.read(buffer, count);
+            count = static_cast<size_t>(s.gcount());
+            m_position = offset + count;
+            return count;
+        }
+
+    }
+}
@@ -0,0 +1,61 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "storage_output_sink.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        ssize_t storage_buffer_sink::write_at(const char *data, size_t length, unsigned long long offset) {
+            if (offset > m_capacity || length > m_capacity - offset) {
+                return -1;
+            }
+            memcpy(m_buffer + offset, data, length);
+            return length;
+        }
+
+        ssize_t storage_fd_sink::write_at(const char *data, size_t length, unsigned long long offset) {
+            if (offset > m_capacity || length > m_capacity - offset) {
+                return -1;
+            }
+            size_t done = 0;
+            while (done < length) {
+                ssize_t res = pwrite(m_fd, data + done, length - done, m_offset + offset + done);
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (res <= 0) {
+                    return -1;
+                }
+                done += res;
+            }
+            return done;
+        }
+
+        storage_stream_sink::storage_stream_sink(storage_ostream stream)
+            : m_stream(stream),
+            m_position(0) {
+            m_start = m_stream.ostream().tellp();
+        }
+
+        ssize_t storage_stream_sink::write_at(const char *data, size_t length, unsigned long long offset) {
+            auto &s = m_stream.ostream();
+            if (offset != m_position) {
+                if (m_start == std::streampos(-1)) {
+                    // The stream can't be repositioned, so the body can't be received again.
+                    return -1;
+                }
+                s.clear();
+                s.seekp(m_start + static_cast<std::streamoff>(offset));
+            }
+            s.write(data, length);
+            if (!s) {
+                return -1;
+            }
+            m_position = offset + length;
+            return length;
+        }
+
+    }
+}
@@ -17,11 +17,29 @@ namespace microsoft_azure {
                     url.append("&");
                 }
                 for (const auto &value : q.second) {
-                    url.append(q.first).append("=").append(value);
+                    url.append(q.first).append("=").append(encode(value, false));
                 }
             }
             return url;
         }
 
+        std::string storage_url::encode(const std::string &value, bool keep_slash) {
+            static const char hex[] = "0123456789ABCDEF";
+            std::string result;
+            result.reserve(value.size());
+            for (size_t i = 0; i < value.size(); i++) {
+                unsigned char c = value[i];
+                if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/')) {
+                    result.push_back(c);
+                }
+                else {
+                    result.push_back('%');
+                    result.push_back(hex[c >> 4]);
+                    result.push_back(hex[c & 0xF]);
+                }
+            }
+            return result;
+        }
+
     }
 }
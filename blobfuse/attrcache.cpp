@@ -0,0 +1,134 @@
+#include "blobfuse.h"
+
+std::shared_ptr<attr_cache> attr_cache::_instance;
+std::mutex attr_cache::s_mutex;
+
+attr_cache* attr_cache::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new attr_cache());
+        }
+    }
+    return _instance.get();
+}
+
+void attr_cache::put(const std::string &path, const struct stat &stbuf, const std::string &etag)
+{
+    if (attr_cache_timeout_in_seconds <= 0)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        erase_negative(path);
+    }
+    m_attrs.put(path, stbuf, etag, time(NULL) + attr_cache_timeout_in_seconds);
+}
+
+bool attr_cache::get(const std::string &path, struct stat *stbuf, bool *unverified)
+{
+    if (attr_cache_timeout_in_seconds <= 0)
+    {
+        return false;
+    }
+
+    return m_attrs.get(path, stbuf, unverified);
+}
+
+bool attr_cache::verify(const std::string &path, const std::string &etag)
+{
+    return m_attrs.verify(path, etag, time(NULL) + attr_cache_timeout_in_seconds);
+}
+
+void attr_cache::put_negative(const std::string &path)
+{
+    if (negative_cache_timeout_in_seconds <= 0)
+    {
+        return;
+    }
+
+    m_attrs.invalidate(path);
+    time_t now = time(NULL);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    erase_negative(path);
+    m_negative_order.push_back(std::make_pair(path, now + negative_cache_timeout_in_seconds));
+    m_negatives[path] = std::prev(m_negative_order.end());
+
+    while (!m_negative_order.empty() && ((m_negatives.size() > max_negative_cache_entries) || (m_negative_order.front().second < now)))
+    {
+        m_negatives.erase(m_negative_order.front().first);
+        m_negative_order.pop_front();
+    }
+}
+
+bool attr_cache::is_negative(const std::string &path)
+{
+    if (negative_cache_timeout_in_seconds <= 0)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_negatives.find(path);
+    if (iter == m_negatives.end())
+    {
+        return false;
+    }
+    if (iter->second->second < time(NULL))
+    {
+        erase_negative(path);
+        return false;
+    }
+    return true;
+}
+
+void attr_cache::invalidate(const std::string &path)
+{
+    m_attrs.invalidate(path);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    erase_negative(path);
+}
+
+void attr_cache::invalidate_tree(const std::string &path)
+{
+    std::string prefix = path;
+    if (prefix.empty() || (prefix.back() != '/'))
+    {
+        prefix.push_back('/');
+    }
+
+    m_attrs.invalidate_tree(path);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    erase_negative(path);
+    auto negative = m_negatives.lower_bound(prefix);
+    while ((negative != m_negatives.end()) && (negative->first.compare(0, prefix.size(), prefix) == 0))
+    {
+        m_negative_order.erase(negative->second);
+        negative = m_negatives.erase(negative);
+    }
+}
+
+bool attr_cache::save(const std::string &file, const std::string &identity)
+{
+    return m_attrs.save(file, identity);
+}
+
+bool attr_cache::load(const std::string &file, const std::string &identity)
+{
+    return m_attrs.load(file, identity);
+}
+
+void attr_cache::erase_negative(const std::string &path)
+{
+    auto iter = m_negatives.find(path);
+    if (iter != m_negatives.end())
+    {
+        m_negative_order.erase(iter->second);
+        m_negatives.erase(iter);
+    }
+}
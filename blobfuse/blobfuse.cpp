@@ -20,11 +20,39 @@ struct options
     const char *config_file; // Connection to Azure Storage information (account name, account key, etc)
     const char *use_https; // True if https should be used (defaults to false)
     const char *file_cache_timeout_in_seconds; // Timeout for the file cache (defaults to 120 seconds)
+    const char *download_parallelism; // Number of ranges of a single blob to download in parallel (defaults to 8)
+    const char *download_range_size_in_mb; // Size of each range downloaded, in MB (defaults to 4)
+    const char *max_readahead_blocks; // Maximum number of blocks to prefetch ahead of a sequential reader (defaults to 8)
+    const char *memory_cache_size_in_mb; // Size of the in-memory block cache, in MB (defaults to 0, disabled)
+    const char *cache_size_in_mb; // Budget for the size of the file cache, in MB (defaults to 0, unbounded)
+    const char *cache_high_watermark; // Percentage of the budget at which files start being evicted from the cache (defaults to 90)
+    const char *cache_low_watermark; // Percentage of the budget that eviction brings the cache back down to (defaults to 80)
+    const char *attr_cache_timeout_in_seconds; // Timeout for attributes of blobs and directories found by listing (defaults to 0, disabled)
+    const char *negative_cache_timeout_in_seconds; // Timeout for paths found not to exist (defaults to 0, disabled)
+    const char *concurrent_getattr; // True if getattr should check for a blob and a directory concurrently (defaults to false)
+    const char *list_cache_timeout_in_seconds; // Timeout for listings of directories (defaults to 0, disabled)
+    const char *list_parallelism; // Number of ranges of a large directory to list concurrently (defaults to 1, sequential)
+    const char *prefetch_parallelism; // Number of subdirectories to list in the background at once (defaults to 0, disabled)
+    const char *persist_metadata; // True if the attribute cache should be saved when unmounting and loaded when mounting (defaults to false)
 };
 
 struct options options;
 struct str_options str_options;
 int file_cache_timeout_in_seconds;
+int download_parallelism;
+unsigned long long download_range_size;
+int max_readahead_blocks;
+unsigned long long memory_cache_size;
+unsigned long long cache_size;
+int cache_high_watermark;
+int cache_low_watermark;
+int attr_cache_timeout_in_seconds;
+int negative_cache_timeout_in_seconds;
+bool concurrent_getattr;
+int list_cache_timeout_in_seconds;
+int list_parallelism;
+int prefetch_parallelism;
+bool persist_metadata;
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 const struct fuse_opt option_spec[] =
@@ -33,6 +61,20 @@ const struct fuse_opt option_spec[] =
     OPTION("--config-file=%s", config_file),
     OPTION("--use-https=%s", use_https),
     OPTION("--file-cache-timeout-in-seconds=%s", file_cache_timeout_in_seconds),
+    OPTION("--download-parallelism=%s", download_parallelism),
+    OPTION("--download-range-size-in-mb=%s", download_range_size_in_mb),
+    OPTION("--max-readahead-blocks=%s", max_readahead_blocks),
+    OPTION("--memory-cache-size-in-mb=%s", memory_cache_size_in_mb),
+    OPTION("--cache-size-in-mb=%s", cache_size_in_mb),
+    OPTION("--cache-high-watermark=%s", cache_high_watermark),
+    OPTION("--cache-low-watermark=%s", cache_low_watermark),
+    OPTION("--attr-cache-timeout-in-seconds=%s", attr_cache_timeout_in_seconds),
+    OPTION("--negative-cache-timeout-in-seconds=%s", negative_cache_timeout_in_seconds),
+    OPTION("--concurrent-getattr=%s", concurrent_getattr),
+    OPTION("--list-cache-timeout-in-seconds=%s", list_cache_timeout_in_seconds),
+    OPTION("--list-parallelism=%s", list_parallelism),
+    OPTION("--prefetch-parallelism=%s", prefetch_parallelism),
+    OPTION("--persist-metadata=%s", persist_metadata),
     FUSE_OPT_END
 };
 
@@ -143,13 +185,27 @@ void *azs_init(struct fuse_conn_info * conn)
     conn->max_readahead = 4194304;
     conn->max_background = 128;
     //  conn->want |= FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_EXPORT_SUPPORT; // TODO: Investigate putting this back in when we downgrade to fuse 2.9
+
+    // The eviction thread has to be started here, rather than in main(), because fuse_main() forks when it daemonizes, and threads don't survive that.
+    if (cache_size > 0)
+    {
+        file_cache_map::get_instance()->start_eviction(cache_size / 100 * cache_high_watermark, cache_size / 100 * cache_low_watermark);
+    }
+    if ((prefetch_parallelism > 0) && (list_cache_timeout_in_seconds > 0))
+    {
+        listing_prefetcher::get_instance()->start(prefetch_parallelism);
+    }
+    if (persist_metadata && (attr_cache_timeout_in_seconds > 0))
+    {
+        metadata_snapshot::get_instance()->start();
+    }
     return NULL;
 }
 
 // TODO: print FUSE usage as well
 void print_usage()
 {
-    fprintf(stdout, "Usage: blobfuse <mount-folder> --config-file=<config-file> --tmp-path=<temp-path> [--use-https=false] [--file-cache-timeout-in-seconds=120]\n");
+    fprintf(stdout, "Usage: blobfuse <mount-folder> --config-file=<config-file> --tmp-path=<temp-path> [--use-https=false] [--file-cache-timeout-in-seconds=120] [--download-parallelism=8] [--download-range-size-in-mb=4] [--max-readahead-blocks=8] [--memory-cache-size-in-mb=0] [--cache-size-in-mb=0] [--cache-high-watermark=90] [--cache-low-watermark=80] [--attr-cache-timeout-in-seconds=60] [--negative-cache-timeout-in-seconds=30] [--concurrent-getattr=false] [--list-cache-timeout-in-seconds=60] [--list-parallelism=1] [--prefetch-parallelism=0] [--persist-metadata=false]\n");
     fprintf(stdout, "Please see https://github.com/Azure/azure-storage-fuse for installation and configuration instructions.\n");
 }
 
@@ -161,7 +217,9 @@ int main(int argc, char *argv[])
     azs_blob_operations.statfs = azs_statfs;
     azs_blob_operations.access = azs_access;
     azs_blob_operations.readlink = azs_readlink;
+    azs_blob_operations.opendir = azs_opendir;
     azs_blob_operations.readdir = azs_readdir;
+    azs_blob_operations.releasedir = azs_releasedir;
     azs_blob_operations.open = azs_open;
     azs_blob_operations.read = azs_read;
     azs_blob_operations.release = azs_release;
@@ -255,6 +313,152 @@ int main(int argc, char *argv[])
         file_cache_timeout_in_seconds = 120;
     }
 
+    download_parallelism = 8;
+    if (options.download_parallelism != NULL)
+    {
+        std::string parallelism(options.download_parallelism);
+        download_parallelism = stoi(parallelism);
+        if (download_parallelism < 1 || download_parallelism > defaultMaxConcurrency)
+        {
+            fprintf(stderr, "--download-parallelism must be between 1 and %d.\n", defaultMaxConcurrency);
+            return 1;
+        }
+    }
+
+    download_range_size = 4ULL * 1024 * 1024;
+    if (options.download_range_size_in_mb != NULL)
+    {
+        std::string range_size(options.download_range_size_in_mb);
+        int range_size_in_mb = stoi(range_size);
+        if (range_size_in_mb < 1)
+        {
+            fprintf(stderr, "--download-range-size-in-mb must be at least 1.\n");
+            return 1;
+        }
+        download_range_size = (unsigned long long)range_size_in_mb * 1024 * 1024;
+    }
+
+    max_readahead_blocks = 8;
+    if (options.max_readahead_blocks != NULL)
+    {
+        std::string readahead(options.max_readahead_blocks);
+        max_readahead_blocks = stoi(readahead);
+        if (max_readahead_blocks < 0)
+        {
+            fprintf(stderr, "--max-readahead-blocks must not be negative.\n");
+            return 1;
+        }
+    }
+
+    memory_cache_size = 0;
+    if (options.memory_cache_size_in_mb != NULL)
+    {
+        std::string cache_size(options.memory_cache_size_in_mb);
+        int cache_size_in_mb = stoi(cache_size);
+        if (cache_size_in_mb < 0)
+        {
+            fprintf(stderr, "--memory-cache-size-in-mb must not be negative.\n");
+            return 1;
+        }
+        memory_cache_size = (unsigned long long)cache_size_in_mb * 1024 * 1024;
+    }
+    block_cache::get_instance()->set_capacity(memory_cache_size);
+
+    cache_size = 0;
+    if (options.cache_size_in_mb != NULL)
+    {
+        std::string size(options.cache_size_in_mb);
+        int cache_size_in_mb = stoi(size);
+        if (cache_size_in_mb < 0)
+        {
+            fprintf(stderr, "--cache-size-in-mb must not be negative.\n");
+            return 1;
+        }
+        cache_size = (unsigned long long)cache_size_in_mb * 1024 * 1024;
+    }
+    cache_high_watermark = 90;
+    if (options.cache_high_watermark != NULL)
+    {
+        std::string watermark(options.cache_high_watermark);
+        cache_high_watermark = stoi(watermark);
+    }
+    cache_low_watermark = 80;
+    if (options.cache_low_watermark != NULL)
+    {
+        std::string watermark(options.cache_low_watermark);
+        cache_low_watermark = stoi(watermark);
+    }
+    if (cache_low_watermark < 0 || cache_low_watermark > cache_high_watermark || cache_high_watermark > 100)
+    {
+        fprintf(stderr, "--cache-low-watermark and --cache-high-watermark must be percentages, with the low watermark no higher than the high watermark.\n");
+        return 1;
+    }
+
+    attr_cache_timeout_in_seconds = 0;
+    if (options.attr_cache_timeout_in_seconds != NULL)
+    {
+        std::string timeout(options.attr_cache_timeout_in_seconds);
+        attr_cache_timeout_in_seconds = stoi(timeout);
+    }
+
+    negative_cache_timeout_in_seconds = 0;
+    if (options.negative_cache_timeout_in_seconds != NULL)
+    {
+        std::string timeout(options.negative_cache_timeout_in_seconds);
+        negative_cache_timeout_in_seconds = stoi(timeout);
+    }
+
+    concurrent_getattr = false;
+    if (options.concurrent_getattr != NULL)
+    {
+        std::string concurrent(options.concurrent_getattr);
+        if (concurrent == "true")
+        {
+            concurrent_getattr = true;
+        }
+    }
+
+    list_cache_timeout_in_seconds = 0;
+    if (options.list_cache_timeout_in_seconds != NULL)
+    {
+        std::string timeout(options.list_cache_timeout_in_seconds);
+        list_cache_timeout_in_seconds = stoi(timeout);
+    }
+
+    list_parallelism = 1;
+    if (options.list_parallelism != NULL)
+    {
+        std::string parallelism(options.list_parallelism);
+        list_parallelism = stoi(parallelism);
+        if (list_parallelism < 1 || list_parallelism > defaultMaxConcurrency)
+        {
+            fprintf(stderr, "--list-parallelism must be between 1 and %d.\n", defaultMaxConcurrency);
+            return 1;
+        }
+    }
+
+    prefetch_parallelism = 0;
+    if (options.prefetch_parallelism != NULL)
+    {
+        std::string parallelism(options.prefetch_parallelism);
+        prefetch_parallelism = stoi(parallelism);
+        if (prefetch_parallelism < 0 || prefetch_parallelism > defaultMaxConcurrency)
+        {
+            fprintf(stderr, "--prefetch-parallelism must be between 0 and %d.\n", defaultMaxConcurrency);
+            return 1;
+        }
+    }
+
+    persist_metadata = false;
+    if (options.persist_metadata != NULL)
+    {
+        std::string persist(options.persist_metadata);
+        if (persist == "true")
+        {
+            persist_metadata = true;
+        }
+    }
+
     // FUSE contains a feature where it automatically implements 'soft' delete if one process has a file open when another calls unlink().
     // This feature causes us a bunch of problems, so we use "-ohard_remove" to disable it, and track the needed 'soft delete' functionality on our own.
     fuse_opt_add_arg(&args, "-ohard_remove");
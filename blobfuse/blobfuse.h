@@ -14,6 +14,15 @@
 #include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <vector>
+#include <list>
+#include <unordered_set>
+#include <future>
+#include <thread>
+#include <chrono>
 #include <dirent.h>
 
 // Declare that we're using version 2.9 of FUSE
@@ -40,18 +49,798 @@ using namespace microsoft_azure::storage;
 // Internal class used for locking, see fileapis.cpp.
 class file_lock_map;
 
+// Size of the blocks in which files opened for reading are fetched from the service and tracked in the file cache.
+const unsigned long long cache_block_size = 4*1024*1024;
+
+// Size of the ranges, and the number of ranges downloaded in parallel, when a whole blob is fetched into the file cache.
+extern unsigned long long download_range_size;
+extern int download_parallelism;
+
+// Maximum number of blocks that are prefetched ahead of a handle that is reading a partial file sequentially.  0 disables readahead.
+extern int max_readahead_blocks;
+
+// Number of blocks uploaded in parallel when a file is uploaded to the service.
+const int upload_parallelism = 8;
+
+// Files up to this size are uploaded with a single Put Blob (see upload_file_to_blob); larger files are uploaded in cache_block_size blocks.
+const unsigned long long single_upload_threshold = 64*1024*1024;
+
+// The service allows at most this many blocks in a block blob.
+const size_t max_block_count = 50000;
+
+// Size of the in-memory block cache, in bytes.  0 disables it.
+extern unsigned long long memory_cache_size;
+
+// Budget for the total size of the files in the cache, in bytes.  0 means the cache is not bounded.
+extern unsigned long long cache_size;
+
+// Tracks the state of a single file in the local file cache.  See filecache.cpp.
+//
+// Files that are opened read-only are not downloaded up-front.  Instead, the file in the cache is created as a sparse file of the blob's size,
+// and each block is fetched from the service (with a ranged GET) the first time it is read.  Such a file is "partial" until every block has been fetched.
+// Files that were downloaded in full, or that were created locally, are "complete", and never go to the service on read.
+class file_cache_entry
+{
+public:
+    explicit file_cache_entry(const std::string blob) : m_id(allocate_id()), m_blob(blob), m_size(0), m_mtime(0), m_block_size(cache_block_size), m_missing_blocks(0), m_stale(false), m_fetches(0), m_fetch_epoch(0), m_writers(0), m_writer_epoch(0), m_generation(0), m_uploaded_generation(0), m_all_modified(false), m_open_handles(0), m_last_access(time(NULL))
+    {
+    }
+
+    // Uniquely identifies this version of the file in the cache; an entry that replaces this one (when the file is re-created) gets a new ID.
+    unsigned long long get_id() const
+    {
+        return m_id;
+    }
+
+    // Gets or sets the name of the blob backing this file.  Updated when the file is renamed.
+    std::string get_blob();
+    void set_blob(const std::string blob);
+
+    // Marks every block of a file of the given size as not yet fetched.  Blocks are block_size bytes each; this is also the size of the range fetched in a single request.
+    // mtime is the modified time of the (freshly created) file in the cache; it is preserved across block fetches, so that fetching blocks doesn't extend the file's cache timeout.
+    void init_partial(unsigned long long size, time_t mtime, unsigned long long block_size);
+
+    // Sets the modified time that is preserved across block fetches, when the file's cache timeout is restarted.
+    void set_mtime(time_t mtime);
+
+    // Marks the file as complete, it will not be fetched from the service again.
+    void mark_complete();
+
+    bool is_complete();
+
+    // Returns true if the blob changed on the service while the file was partial, so the blocks already fetched can't be combined with any more of it.
+    // Reads of missing blocks then fail with ESTALE, and the next azs_open() replaces the entry and the file in the cache.
+    bool is_stale();
+
+    // Truncates the file in the cache at path to zero length, and marks it complete.  Block fetches that are in flight are waited for first, and their
+    // results discarded, so that none of them can write stale data back into the file after it's truncated.  Returns 0, or -1 with errno set.
+    int truncate_file(const char *path);
+
+    // Size of the blob, and of the blocks it is fetched in.  Only meaningful while the file is partial.
+    unsigned long long get_size();
+    unsigned long long get_block_size();
+
+    // Ensures that the given range of the file is present in the cache file, fetching any missing blocks from the service.
+    // fd must be a handle to the cache file that is open for writing.
+    // Returns 0 on success, or -errno on failure.
+    int ensure_range(int fd, off_t offset, size_t size);
+
+    // Tracks the handles that are open for writing to the file.  add_writer returns the writer epoch, which changes whenever
+    // a handle is opened for writing, or the file is truncated by path.
+    unsigned long long add_writer();
+    void remove_writer();
+    void note_truncate();
+
+    // Returns true if the handle that was given 'epoch' by add_writer is the only handle that has written to the file since.
+    bool is_sole_writer(unsigned long long epoch);
+
+    // Tracks the handles open to the file, and when the file was last opened, read, written or closed, for eviction from the cache.
+    // touch() is called on every read and write, so it doesn't take the lock.
+    void add_handle();
+    void remove_handle();
+    void touch();
+    time_t get_last_access();
+
+    // Returns true if the file can be removed from the cache: it has no open handles, and no modifications that haven't been uploaded.
+    bool is_evictable();
+
+    // Tracks modifications to the file, shared by every handle open to it, so that the file is only uploaded if it changed since it was last uploaded.
+    // mark_modified must be called after the modification has been made to the file in the cache.  To upload the file, get the generation first,
+    // then upload, then pass that generation to mark_uploaded; any modifications made during the upload are then still considered pending.
+    // The first overload marks the whole file as modified; the second only the given range.
+    void mark_modified();
+    void mark_modified(off_t offset, size_t size);
+    unsigned long long get_generation();
+    bool is_modified();
+    void mark_uploaded(unsigned long long generation);
+
+    // Gets the ranges of the file (as a map from start to end offset) that have been modified since it was last uploaded.
+    // Returns false if they aren't known, in which case the whole file has to be uploaded.
+    bool get_modified_ranges(std::map<unsigned long long, unsigned long long> &ranges);
+
+    // Gets or sets the ETag of the blob as of the last time the file in the cache was known to match it.  Empty if unknown.
+    std::string get_etag();
+    void set_etag(const std::string etag);
+
+    // Fetches every block that isn't present yet, completing the file.  Up to 'parallelism' blocks are downloaded at once, each over its own connection.
+    // Returns 0 on success, or -errno on failure.
+    int fetch_all(int fd, int parallelism);
+
+private:
+    enum block_state : char
+    {
+        block_missing,
+        block_fetching,
+        block_present
+    };
+
+    static unsigned long long allocate_id();
+
+    // Fetches the given block from the service, and writes it to the cache file, if the blob still has the given ETag.  Must be called without holding m_mutex.
+    int fetch_block(int fd, const std::string &blob, const std::string &etag, size_t index);
+
+    // Fetches the blocks in [first, last], or waits for other threads that are already fetching them.
+    int ensure_blocks(int fd, size_t first, size_t last);
+
+    const unsigned long long m_id;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::string m_blob;
+    unsigned long long m_size;
+    time_t m_mtime;
+    unsigned long long m_block_size;
+    std::vector<block_state> m_block_states; // Empty if the file is complete.
+    size_t m_missing_blocks;
+    bool m_stale;
+    int m_fetches; // Blocks being fetched right now.
+    unsigned long long m_fetch_epoch; // Incremented when the block states are discarded; fetches started before then drop their results.
+    int m_writers;
+    unsigned long long m_writer_epoch;
+    unsigned long long m_generation;
+    unsigned long long m_uploaded_generation;
+    std::map<unsigned long long, unsigned long long> m_modified_ranges; // Non-overlapping, from start to end offset.
+    bool m_all_modified; // True if the modified ranges are not known.
+    std::string m_etag;
+    int m_open_handles;
+    std::atomic<time_t> m_last_access;
+};
+
+// Uploads only the blocks of the blob that overlap the given modified ranges of the file, and commits a block list that reuses the blob's other committed blocks.  See blockupload.cpp.
+// The block list is only committed if the blob still has the given ETag, that is, if the rest of the file in the cache still matches the blob.
+// Returns false if the blob can't be updated this way (for example, it wasn't uploaded in blocks, or has been changed on the service), in which case the caller must upload the whole file.
+// On success, new_etag is set to the ETag of the blob's new version.
+bool upload_modified_blocks(const std::string &mntPath, const std::string &blob, unsigned long long size, const std::map<unsigned long long, unsigned long long> &modified_ranges, const std::string &etag, std::string &new_etag);
+
+// Maps each path in the file cache to its file_cache_entry.  See filecache.cpp.
+class file_cache_map
+{
+public:
+    static file_cache_map* get_instance();
+
+    // Gets the entry for the given path, creating a (complete) entry if there isn't one.
+    std::shared_ptr<file_cache_entry> get_entry(const std::string &path);
+
+    // Replaces the entry for the given path with a new one.  Used when the file in the cache is re-created.
+    // Handles to the prior version of the file keep (and continue to use) the prior entry.
+    std::shared_ptr<file_cache_entry> reset_entry(const std::string &path);
+
+    void remove_entry(const std::string &path);
+
+    void rename_entry(const std::string &src, const std::string &dst);
+
+    // Starts a background thread that keeps the total size of the files in the cache within a budget.  When the size goes over high_watermark bytes,
+    // files that can be evicted are removed, least recently used first, until the size is below low_watermark bytes.
+    void start_eviction(unsigned long long high_watermark, unsigned long long low_watermark);
+    void stop_eviction();
+
+protected:
+    file_cache_map() : m_stop_eviction(false)
+    {
+    }
+
+private:
+    void run_eviction(unsigned long long high_watermark, unsigned long long low_watermark);
+
+    static std::shared_ptr<file_cache_map> _instance;
+    static std::mutex s_mutex;
+    std::mutex m_mutex;
+    std::map<std::string, std::shared_ptr<file_cache_entry>> m_entries;
+    std::thread m_eviction_thread;
+    std::mutex m_eviction_mutex;
+    std::condition_variable m_eviction_cv;
+    bool m_stop_eviction;
+};
+
+// An in-memory cache of blocks of files, in front of the file cache on disk.  See blockcache.cpp.
+//
+// Blocks are cache_block_size bytes (the last block of a file may be shorter), and are keyed by the file_cache_entry ID and generation of the file, and the block index.
+// Because every modification changes the generation, and every re-creation of the file in the cache changes the ID, a cached block is never stale; blocks of
+// old versions of a file are simply no longer looked up, and age out.  The disk cache always holds every block too, so evicting a block loses nothing.
+// Blocks are promoted from disk the second time they are missed, so that a single sequential pass over a large file doesn't flush the cache.
+// The cache is split into shards, each with its own lock, LRU list and share of the byte budget.
+class block_cache
+{
+public:
+    static block_cache* get_instance();
+
+    void set_capacity(unsigned long long capacity);
+
+    bool enabled() const
+    {
+        return m_capacity > 0;
+    }
+
+    // Copies the given range of the file from the cache, if every block that covers it is cached.
+    // Returns the number of bytes copied (which is short only at the end of the file), or -1 if any block is missing.
+    ssize_t read(unsigned long long id, unsigned long long generation, char *buf, size_t size, off_t offset);
+
+    // Called after a read from the file cache on disk missed in this cache.  Reads, from fd, and caches any block in the range that has been missed before
+    // (other than by the same reader, reading sequentially through the block.)  reader identifies the handle.
+    void promote(unsigned long long id, unsigned long long generation, int fd, off_t offset, size_t size, const void *reader);
+
+    // Drops all cached blocks of the given file.
+    void remove_file(unsigned long long id);
+
+protected:
+    block_cache() : m_capacity(0)
+    {
+    }
+
+private:
+    struct block_key
+    {
+        unsigned long long id;
+        unsigned long long generation;
+        size_t index;
+
+        bool operator<(const block_key &other) const
+        {
+            if (id != other.id)
+            {
+                return id < other.id;
+            }
+            if (generation != other.generation)
+            {
+                return generation < other.generation;
+            }
+            return index < other.index;
+        }
+    };
+
+    struct cached_block
+    {
+        std::shared_ptr<std::vector<char>> data;
+        std::list<block_key>::iterator lru_position;
+    };
+
+    struct ghost_block
+    {
+        std::list<block_key>::iterator lru_position;
+        const void *reader; // The handle that last missed the block,
+        unsigned long long next_offset; // and where in the block that handle would read next, if it's reading sequentially.
+    };
+
+    struct shard
+    {
+        shard() : size(0)
+        {
+        }
+
+        std::mutex mutex;
+        std::map<block_key, cached_block> blocks;
+        std::list<block_key> lru; // Most recently used first.
+        unsigned long long size;
+        std::map<block_key, ghost_block> ghosts; // Blocks that have missed once, and will be promoted the next time they miss.
+        std::list<block_key> ghost_lru;
+    };
+
+    static const size_t shard_count = 16;
+
+    shard &get_shard(const block_key &key);
+    std::shared_ptr<std::vector<char>> lookup(const block_key &key);
+    void insert(const block_key &key, std::shared_ptr<std::vector<char>> data);
+    bool should_promote(const block_key &key, const void *reader, unsigned long long start, unsigned long long end);
+
+    static std::shared_ptr<block_cache> _instance;
+    static std::mutex s_mutex;
+    unsigned long long m_capacity;
+    shard m_shards[shard_count];
+};
+
+// If true, azs_getattr() finds out whether a path is a blob, a directory or neither with one list request, rather than a HEAD request followed,
+// if there is no blob, by a list request.  This halves the latency of looking up a directory.  Directories are then always reported as not empty.
+extern bool concurrent_getattr;
+
+// Number of names requested by the list request of a concurrent_getattr lookup.  A few are enough to get past names that sort between a blob and the directory of the same name.
+const int getattr_list_results = 8;
+
+// Number of seconds the attributes of a blob or directory found by listing are trusted by azs_getattr().  0 disables the attribute cache.
+extern int attr_cache_timeout_in_seconds;
+
+// Number of seconds a path that azs_getattr() found not to exist is remembered as not existing.  0 disables the negative cache.
+extern int negative_cache_timeout_in_seconds;
+
+// Maximum number of nonexistent paths remembered; the oldest are forgotten first.
+const size_t max_negative_cache_entries = 65536;
+
+// A compact store of the attributes of blobs and directories, keyed by path, for caching the namespace of containers with tens of millions of blobs.
+// See nametree.cpp.
+//
+// Each path is a node in a tree of path components.  A node holds only its own name (in an arena of names, rather than as a std::string of the full
+// path), the ID of its parent, and a fixed-size record of the attributes (type, size, modification time and a hash of the ETag): 48 bytes plus the
+// name and a hash table slot, a small fraction of a std::map entry keyed by the full path, or of a list_blobs_hierarchical_item.
+//
+// Nodes are found by hashing (parent ID, name) into one of 64 shards, each with its own lock, hash table, nodes and arena, so lookups of
+// different paths rarely contend.  Changes are serialized by another lock, so lookups only ever take the lock of the shard they're looking in.
+// A lookup holds one shard lock at a time, so a node on its path can be removed, and its index reused, between one component and the next; lookups
+// that overlap a removal are repeated with changes held off.
+// Invalidating a subtree only marks its root; entries under it are treated as missing from then on, and are removed once they expire.
+class name_tree
+{
+public:
+    name_tree();
+
+    // Sets the attributes of the given path, which expire at the given time.
+    void put(const std::string &path, const struct stat &stbuf, const std::string &etag, time_t expiry);
+
+    // Copies the attributes of the given path into stbuf.  Returns false if there are none, or they have expired.
+    // Sets unverified if they were loaded from a snapshot, and haven't been set or verified since.
+    bool get(const std::string &path, struct stat *stbuf, bool *unverified);
+
+    // Marks the attributes of the given path as verified, with the given expiry, if they were set with the given ETag.  Returns false if they weren't.
+    bool verify(const std::string &path, const std::string &etag, time_t expiry);
+
+    // Removes the attributes of the given path.
+    void invalidate(const std::string &path);
+
+    // Removes the attributes of the given path, and of every path under it.
+    void invalidate_tree(const std::string &path);
+
+    // Writes the tree to the given file, tagged with identity.  Changes wait until it's written; lookups don't.
+    bool save(const std::string &file, const std::string &identity);
+
+    // Replaces the tree with the one in the given file, if it was saved with the same identity.  The attributes in it are unverified, and don't expire
+    // until they're verified or set again.  Must be called before the tree is used.
+    bool load(const std::string &file, const std::string &identity);
+
+private:
+    struct node
+    {
+        unsigned long long size;
+        long long mtime;
+        uint32_t parent; // The ID of the parent node, or root_id.  For a free node, the index of the next free node in the shard.
+        uint32_t name; // Offset of the name in the shard's arena.
+        uint32_t child_count; // free_node for a free node.
+        uint32_t expiry; // Seconds after m_epoch.
+        uint32_t stamp; // The value of m_invalidations when the attributes were set.
+        uint32_t invalidated; // The value of m_invalidations when the subtree under this node was last invalidated.
+        uint32_t etag_hash;
+        uint16_t name_length : 15;
+        uint16_t unverified : 1; // The attributes were loaded from a snapshot.
+        uint16_t mode; // 0 if the node has no attributes (it's only on the way to other nodes.)
+    };
+
+    struct shard
+    {
+        shard() : used(0), garbage(0), free_list(0xFFFFFFFF), slots(1024, 0)
+        {
+        }
+
+        std::mutex mutex;
+        std::vector<node> nodes;
+        size_t used; // Nodes that aren't free.
+        size_t garbage; // Bytes of the arena that are names of freed nodes.
+        uint32_t free_list;
+        std::vector<uint32_t> slots; // Open-addressed hash table of node index + 1; 0 is an empty slot.
+        std::vector<char> names; // The arena.
+    };
+
+    // Node IDs hold the shard in the low shard_bits bits, and the node's index in the shard in the rest.
+    static const int shard_bits = 6;
+    static const size_t shard_count = 1 << shard_bits;
+
+    static uint32_t make_id(size_t shard, uint32_t index);
+    static size_t shard_of(uint32_t id); // Also picks the shard for a hash.
+    static uint32_t index_of(uint32_t id);
+
+    // Returns the ID of the node for the path, or root_id if there's none.  Copies the node into found, and the latest invalidation of it or any node above it
+    // into invalidated.  Unless m_write_mutex is held, the result is only right if m_removals is the same before and after.
+    uint32_t lookup(const std::string &path, node *found, uint32_t *invalidated);
+    size_t find_slot(shard &s, uint32_t hash, uint32_t parent, const char *name, size_t length);
+    uint32_t add(shard &s, size_t slot, uint32_t parent, const char *name, size_t length);
+    void remove(shard &s, uint32_t index);
+    void rehash(shard &s);
+    void compact_names(shard &s);
+    void prune();
+
+    // Returns true if every offset, index and ID in the shards refers to something in them, and the counts, free lists and hash tables agree with the nodes.
+    bool check_shards(shard *shards);
+
+    shard m_shards[shard_count];
+    std::mutex m_write_mutex;
+    time_t m_epoch;
+    uint32_t m_invalidations; // Number of subtrees invalidated so far.
+    std::atomic<uint32_t> m_root_invalidated;
+    std::atomic<uint32_t> m_removals; // Odd while nodes are being removed; incremented before and after.
+    size_t m_size; // Nodes in all shards.
+    size_t m_next_prune; // Expired entries are removed when the tree grows to this size.
+};
+
+// A cache of the attributes of blobs and directories on the service, keyed by path.  See attrcache.cpp.
+//
+// azs_readdir() fills it from the listing it has already made, so that the getattr calls that typically follow (from 'ls -l', 'find', etc.)
+// don't need a request to the service per entry.  Entries expire after attr_cache_timeout_in_seconds, and are invalidated by local changes to the path.
+// Files in the local file cache are never looked up here; their attributes come from the file on disk.  The attributes are held in a name_tree,
+// so that those of every blob in a large container fit in memory.
+//
+// It also remembers paths that azs_getattr() found not to exist, for negative_cache_timeout_in_seconds, so that repeated lookups of them
+// (compilers searching include paths, shells searching PATH, etc.) are answered without a request to the service.
+class attr_cache
+{
+public:
+    static attr_cache* get_instance();
+
+    // Caches the attributes of the given path, and its ETag if known.
+    void put(const std::string &path, const struct stat &stbuf, const std::string &etag = std::string());
+
+    // Copies the cached attributes of the given path into stbuf.  Returns false if there are none, or they have expired.
+    // If unverified is given, sets it if the attributes came from the snapshot of an earlier mount, and haven't been checked against the service yet.
+    bool get(const std::string &path, struct stat *stbuf, bool *unverified = NULL);
+
+    // Marks the cached attributes of the given path as checked against the service, if they were cached with the given ETag.  Returns false if they weren't.
+    bool verify(const std::string &path, const std::string &etag);
+
+    // Remembers that the given path does not exist.
+    void put_negative(const std::string &path);
+
+    // Returns true if the given path was recently found not to exist.
+    bool is_negative(const std::string &path);
+
+    // Removes the given path from the cache, whether it's cached as existing or not.
+    void invalidate(const std::string &path);
+
+    // Removes the given path, and every path under it, from the cache.
+    void invalidate_tree(const std::string &path);
+
+    // Saves the attributes (not the nonexistent paths) to the given file, or loads them from it.  See metadata_snapshot.
+    bool save(const std::string &file, const std::string &identity);
+    bool load(const std::string &file, const std::string &identity);
+
+protected:
+    attr_cache()
+    {
+    }
+
+private:
+    void erase_negative(const std::string &path); // Must be called with m_mutex held.
+
+    static std::shared_ptr<attr_cache> _instance;
+    static std::mutex s_mutex;
+    name_tree m_attrs;
+    std::mutex m_mutex; // Guards the negative entries.
+
+    // Nonexistent paths, with the time each expires, oldest first.  Since they all have the same timeout, this is also the order in which they expire.
+    std::list<std::pair<std::string, time_t>> m_negative_order;
+    std::map<std::string, std::list<std::pair<std::string, time_t>>::iterator> m_negatives;
+};
+
+// Number of list requests a listing of a large directory is split into, to be run concurrently.  1 lists directories sequentially.
+extern int list_parallelism;
+
+// Lists the rest of a large directory (one whose listing didn't fit in one page) by splitting it into ranges of names, and listing the ranges concurrently.
+// See shardedlisting.cpp.
+//
+// The listing carries on sequentially until a page shows names that differ in the byte after the range's prefix; the rest of the range is then
+// split by that byte, into one range (one list prefix) per byte value that can appear there in UTF-8.  Each of those is split again the same way,
+// up to max_list_split_depth bytes beyond the directory's prefix.  Since every range costs a request even if it's empty, names that share a long
+// common prefix are not split on until they branch.  Pages are returned in the order of the names in them, the same order as a sequential listing.
+class sharded_listing
+{
+public:
+    // Lists the names with the given prefix that come after start_after, which is the last name in the first page of the sequential listing,
+    // and continuation, the marker that page returned.
+    sharded_listing(const std::string &container, const std::string &prefix, const std::string &start_after, const std::string &continuation, int parallelism);
+    ~sharded_listing();
+
+    // Gets the next page of the listing.  Returns 0, with an empty page once the listing is complete, or the errno of a list request that failed.
+    int next_page(std::vector<list_blobs_hierarchical_item> &page);
+
+private:
+    struct range
+    {
+        std::string prefix;
+        std::string start_after; // Names up to and including this one have already been listed.
+        size_t depth; // Number of bytes this range's prefix has beyond the directory's.
+        bool probe; // The range of names in a subdirectory, which appears in the listing as a single directory entry, if there are any.
+        bool fetching;
+        bool finished;
+        std::string continuation;
+        std::list<std::vector<list_blobs_hierarchical_item>> pages;
+    };
+
+    void run();
+    std::list<range>::iterator find_work(); // Must be called with m_mutex held.
+    void split(std::list<range>::iterator position, const std::string &prefix, const std::string &start_after, size_t depth); // Must be called with m_mutex held.
+
+    std::string m_container;
+    size_t m_max_buffered_pages;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::list<range> m_ranges; // In the order of the names in them.  Ranges before m_current have been returned, and removed.
+    std::list<range>::iterator m_current;
+    size_t m_buffered_pages;
+    int m_error;
+    bool m_stop;
+    std::vector<std::thread> m_workers;
+};
+
+const size_t max_list_split_depth = 3;
+
+// A child of a directory, as found by listing the directory: its name, and its attributes.
+typedef std::pair<std::string, struct stat> dir_entry;
+
+// Number of seconds the listing of a directory on the service is reused by azs_readdir().  0 disables the listing cache.
+extern int list_cache_timeout_in_seconds;
+
+// Listings of directories with more children than this are not cached.
+const size_t max_cached_listing_size = 65536;
+
+// Maximum total number of children in all cached listings; the oldest listings are dropped first.
+const size_t max_listing_cache_entries = 262144;
+
+// A cache of the listings of directories on the service, keyed by the path of the directory (with a trailing '/').  See listingcache.cpp.
+//
+// azs_readdir() stores the listing of a directory once it has read all of it, and serves later reads of the directory from it until it expires.
+// Local changes invalidate the listing of the directory they change, and renaming a directory invalidates the listings of everything under it.
+class listing_cache
+{
+public:
+    static listing_cache* get_instance();
+
+    // Returns a number that changes whenever a listing is invalidated.
+    unsigned long long get_generation();
+
+    // Caches the listing of the given directory.  generation is the result of get_generation() from before the directory was listed; if any listing
+    // has been invalidated since, the listing may be missing the change, so it isn't cached.
+    void put(const std::string &path, std::shared_ptr<const std::vector<dir_entry>> listing, unsigned long long generation);
+
+    // Returns the cached listing of the given directory, or null if there is none, or it has expired.
+    std::shared_ptr<const std::vector<dir_entry>> get(const std::string &path);
+
+    // Removes the listing of the directory that contains the given path (which has no trailing '/'.)
+    void invalidate_parent(const std::string &path);
+
+    // Removes the listing of the given directory, and of every directory under it.
+    void invalidate_tree(const std::string &path);
+
+protected:
+    listing_cache() : m_size(0), m_generation(0)
+    {
+    }
+
+private:
+    struct cached_listing
+    {
+        std::shared_ptr<const std::vector<dir_entry>> listing;
+        time_t expiry;
+        std::list<std::string>::iterator order_position;
+    };
+
+    void erase(std::map<std::string, cached_listing>::iterator iter); // Must be called with m_mutex held.
+
+    static std::shared_ptr<listing_cache> _instance;
+    static std::mutex s_mutex;
+    std::mutex m_mutex;
+    std::map<std::string, cached_listing> m_listings;
+    std::list<std::string> m_order; // Oldest first.
+    size_t m_size; // Total number of children in all cached listings.
+    unsigned long long m_generation;
+};
+
+// Tracks the access pattern of a single handle to a partial file, and prefetches blocks in the background ahead of a sequential reader.  See filecache.cpp.
+//
+// The readahead window starts at one block, and doubles (up to max_readahead_blocks) each time the reader moves sequentially into a new block.
+// A read that isn't sequential cancels the blocks that haven't been started yet, and shrinks the window back to one block.
+class readahead_state
+{
+public:
+    readahead_state(std::shared_ptr<file_cache_entry> cache_entry, int fd);
+
+    // Cancels any pending readahead, and waits for in-flight block fetches to complete.  Must happen before fd is closed.
+    ~readahead_state();
+
+    // Called for every read on the handle, before the read itself is satisfied.
+    void on_read(off_t offset, size_t size);
+
+private:
+    void worker(unsigned int generation);
+
+    std::mutex m_mutex;
+    std::shared_ptr<file_cache_entry> m_cache_entry;
+    int m_fd;
+    off_t m_next_offset; // Where the next read is expected to start, if the handle is being read sequentially.
+    size_t m_last_block; // The block in which the previous read ended.
+    size_t m_window; // Current readahead window, in blocks.  0 until the handle has been read sequentially.
+    size_t m_next_block; // The next block to be claimed by a readahead worker.
+    size_t m_end_block; // One past the last block to prefetch.
+    unsigned int m_generation; // Incremented when readahead is cancelled; workers from an older generation stop claiming blocks.
+    int m_active_workers;
+    std::vector<std::future<void>> m_workers;
+};
+
+// Uploads the blocks of a large file in the background as a single handle writes them, so that the upload overlaps with the application's writes.  See writebehind.cpp.
+//
+// Once the file has grown past single_upload_threshold, each block of cache_block_size bytes is staged (with Put Block) as soon as every byte before its end has been written.
+// Flush then only has to stage the last, partial block and commit the block list.  A write to a block that has already been staged abandons the write-behind,
+// and the file is uploaded in full on flush instead, as it is for any file written through more than one handle.
+class write_behind
+{
+public:
+    write_behind(std::shared_ptr<file_cache_entry> cache_entry, unsigned long long writer_epoch, const std::string &mntPath);
+
+    // Waits for in-flight block uploads to complete.
+    ~write_behind();
+
+    // Called after each successful write on the handle.
+    void on_write(off_t offset, size_t size);
+
+    // Stages any blocks that haven't been staged yet, and commits the blob from the staged blocks.
+    // Returns true if the blob was committed, and sets etag to the ETag of its new version; otherwise the caller must upload the whole file.
+    bool commit(const std::string &blob, unsigned long long size, std::string &etag);
+
+private:
+    void abandon();
+    void stage_block(size_t index, size_t length);
+    bool wait_for_uploads();
+
+    std::mutex m_mutex;
+    std::shared_ptr<file_cache_entry> m_cache_entry;
+    unsigned long long m_writer_epoch;
+    int m_fd; // A read-only handle to the file in the cache, used to read back blocks to upload.
+    std::string m_blob; // The blob the blocks were staged to.
+    unsigned long long m_written; // Every byte before this offset has been written by the handle.
+    std::map<unsigned long long, unsigned long long> m_pending; // Ranges written out of order beyond m_written, by start offset.
+    size_t m_staged_blocks; // Number of full blocks that have been staged, or are being staged.
+    bool m_abandoned;
+    std::vector<std::future<int>> m_uploads;
+};
+
 // FUSE gives you one 64-bit pointer to use for communication between API's.
 // An instance of this struct is pointed to by that pointer.
 struct fhwrapper
 {
     int fh; // The handle to the file in the file cache to use for read/write operations.
     bool upload; // True if the blob should be uploaded when the file is closed.  (False when the file was opened in read-only mode.)
+    std::shared_ptr<file_cache_entry> cache_entry; // State of the file in the cache.  Used to fetch blocks on read, if the file is partial.
+    std::unique_ptr<readahead_state> readahead; // Set only for handles opened read-only to a partial file.
+    std::unique_ptr<write_behind> writer; // Set only for handles that created or truncated the file, and so may write it sequentially from the start.
     fhwrapper(int fh, bool upload) : fh(fh), upload(upload)
     {
 
+    }
+    fhwrapper(int fh, bool upload, std::shared_ptr<file_cache_entry> cache_entry) : fh(fh), upload(upload), cache_entry(cache_entry)
+    {
+
+    }
+};
+
+// The state of a directory opened for reading, pointed to by the fh of its fuse_file_info.  See azs_readdir().
+struct dirhandle
+{
+    std::mutex mutex;
+    std::string path; // Path of the directory, with a trailing '/'.
+    std::string prefix; // Prefix of the names of the blobs in the directory.
+    std::vector<dir_entry> local_entries; // Entries found in the local cache when the directory was opened.
+    std::unordered_set<std::string> local_names; // Their names, so that the same entries found on the service can be skipped.
+    std::shared_ptr<const std::vector<dir_entry>> page; // The current page of the listing of the directory on the service, or the whole listing, if it was cached.
+    off_t page_offset; // The entry number of the first entry in the page.
+    std::string continuation; // The continuation token for the next page.
+    std::string prior; // The name of the last blob of the previous page.
+    bool listing_started;
+    std::shared_ptr<std::vector<dir_entry>> listing; // The listing so far, to be cached once it's complete.  Null if it's too large to cache.
+    unsigned long long listing_generation; // The listing cache's generation when the listing was started.
+    std::unique_ptr<sharded_listing> sharded; // Lists the rest of the directory, if it's large and list_parallelism > 1.
+    bool prefetch_subdirectories; // True if the subdirectories found should be listed in the background.  Set for directories opened through FUSE.
+    dirhandle(const std::string &path) : path(path), prefix(path.substr(1)), page(std::make_shared<std::vector<dir_entry>>()), page_offset(0), listing_started(false), listing_generation(0), prefetch_subdirectories(false)
+    {
+
     }
 };
 
+// Fetches and parses the next page of the listing of the directory into dh->page.  See directoryapis.cpp.
+// Returns 0 on success, or the errno of the last attempt once out of retries.
+int fetch_next_page(struct dirhandle *dh);
+
+// Number of subdirectories that are listed at once in the background, after their parent is read.  0 disables prefetching.
+extern int prefetch_parallelism;
+
+// Lists subdirectories in the background, into the listing cache, so that a tree walk (find, du, rsync, etc.) finds the listing of each directory
+// it reads, and the attributes of the entries in it, already cached.  See prefetch.cpp.
+//
+// azs_readdir() queues each subdirectory it finds.  Only those are listed; their own subdirectories are queued when the walker reads them.
+// Most walkers go depth-first, so the subdirectories found most recently are listed first.  The queue is bounded; when it's full,
+// the subdirectories that were queued first are dropped.
+class listing_prefetcher
+{
+public:
+    static listing_prefetcher* get_instance();
+
+    // Starts the given number of threads that list queued directories.
+    void start(int thread_count);
+    void stop();
+
+    // Queues the given directories (with trailing '/'s), found in the same listing, to be listed in order, ahead of those queued before.
+    void enqueue(const std::vector<std::string> &paths);
+
+protected:
+    listing_prefetcher() : m_stop(false)
+    {
+    }
+
+private:
+    void run();
+
+    static std::shared_ptr<listing_prefetcher> _instance;
+    static std::mutex s_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::list<std::string> m_queue;
+    std::unordered_set<std::string> m_queued;
+    std::vector<std::thread> m_threads;
+    bool m_stop;
+};
+
+const size_t max_prefetch_queue_size = 4096;
+
+// If true, the attribute cache is saved to the tmp path when unmounted (and every metadata_snapshot_interval_in_seconds), and loaded again when mounted.
+extern bool persist_metadata;
+
+const int metadata_snapshot_interval_in_seconds = 300;
+const int metadata_revalidation_threads = 4;
+const size_t max_revalidation_queue_size = 4096;
+
+// Keeps the attribute cache across mounts, so that a remounted container doesn't have to be listed again before lookups are fast.  See snapshot.cpp.
+//
+// The attributes loaded from the snapshot are used as they are, and the first lookup of each path checks it against the service in the background:
+// a blob is verified if its ETag hasn't changed, and a directory if it still has anything in it.  Otherwise the attributes are replaced, or removed.
+// So a path changed by another client while the container wasn't mounted is seen as it was, until shortly after it's first looked up.
+class metadata_snapshot
+{
+public:
+    static metadata_snapshot* get_instance();
+
+    // Loads the snapshot for this container, if there is one, and starts the threads that save it and revalidate the attributes loaded from it.
+    void start();
+
+    // Stops the threads, and saves the snapshot.
+    void stop();
+
+    // Queues the given path, whose attributes were loaded from the snapshot, to be checked against the service.
+    void revalidate(const std::string &path);
+
+protected:
+    metadata_snapshot() : m_stop(false)
+    {
+    }
+
+private:
+    std::string file() const;
+    std::string identity() const;
+    void save();
+    void run_saver();
+    void run_revalidator();
+    void revalidate_now(const std::string &path);
+
+    static std::shared_ptr<metadata_snapshot> _instance;
+    static std::mutex s_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::list<std::string> m_queue;
+    std::unordered_set<std::string> m_queued;
+    std::vector<std::thread> m_threads;
+    bool m_stop;
+};
+
 
 // Global struct storing the Storage connection information and the tmpPath.
 struct str_options
@@ -85,12 +874,37 @@ int map_errno(int error);
 // Input is the logical file name being input to the FUSE API, output is the file name of the on-disk file in the file cache.
 std::string prepend_mnt_path_string(const std::string path);
 
+// Removes the file at the given path from the cache, if it's still evictable (see file_cache_entry::is_evictable.)  Returns true if the file was removed.
+bool evict_from_cache(const std::string path);
+
 // Helper function to create all directories in the path if they don't already exist.
 int ensure_files_directory_exists_in_cache(const std::string file_path);
 
-// Greedily list all blobs using the input params.
+// Greedily list all blobs using the input params.  The rest of a directory that takes more than one page is listed by a sharded_listing, if list_parallelism > 1.
 std::vector<list_blobs_hierarchical_item> list_all_blobs_hierarchical(std::string container, std::string delimiter, std::string prefix);
 
+// Paces the retries of a list request that keeps failing.  See utilities.cpp.
+// Transient errors (timeouts, throttling, server errors and failed connections) are retried after a delay that doubles each time, with jitter,
+// so that clients listing the same container don't retry in step.  Other errors aren't retried, and retrying stops after max_list_retry_seconds.
+class list_retry
+{
+public:
+    list_retry();
+
+    // Called after the request failed with the given errno.  Waits and returns 0 if the request should be retried; otherwise returns the
+    // error to give up with: the request's own error if it isn't transient, or EIO if retrying has taken too long.
+    int wait(int error);
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+    unsigned int m_attempts;
+    unsigned int m_seed;
+};
+
+const int max_list_retry_seconds = 60;
+const int min_list_retry_delay_ms = 100;
+const int max_list_retry_delay_ms = 5000;
+
 // Return 'true' if there is at least one blob listed under the input prefix.
 bool list_one_blob_hierarchical(std::string container, std::string delimiter, std::string prefix);
 
@@ -137,26 +951,42 @@ int azs_statfs(const char *path, struct statvfs *stbuf);
  */
 int azs_mkdir(const char *path, mode_t mode);
 
+/**
+ * Open a directory for reading.  Scans the directory in the local cache, and sets up the handle that azs_readdir() pages the listing of the directory through.
+ *
+ * @param  path The path to the directory to open
+ * @param  fi   File info.  Its fh is set to the dirhandle.
+ * @return      0
+ */
+int azs_opendir(const char *path, struct fuse_file_info *fi);
+
 /**
  * Read the contents of a directory.  For each entry to add, call the filler function with the input buffer,
- * the name of the entry, and additional data about the entry.  TODO: Keep the data (somehow) for latter getattr calls.
+ * the name of the entry, and additional data about the entry.  The listing is fetched from the service one page at a time, as it is read.
  *
  * @param  path   Path to the directory to read.
  * @param  buf    Buffer to pass into the filler function.  Not otherwise used in this function.
  * @param  filler Function to call to add directories and files as they are discovered.
- * @param  offset Not used
+ * @param  offset Number of the entry to start from.
  * @param  fi     File info about the directory to be read.
- * @return        TODO: error codes.
+ * @return        0 on success, or -errno if listing the directory failed.
  */
 int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 
+/**
+ * Close a directory opened by azs_opendir().
+ *
+ * @param  path The path to the directory
+ * @param  fi   File info.  Its fh is the dirhandle to free.
+ * @return      0
+ */
+int azs_releasedir(const char *path, struct fuse_file_info *fi);
+
 
 /**
  * Open an item (a file) for writing or reading.
- * At the moment, we cache the file locally in its entirety to the SSD before uploading to blob storage.
- * TODO: Implement in-memory caching.
- * TODO: Implement block-level buffering.
- * TODO: If opening for reading, cache the file locally.
+ * Files opened for writing are cached locally in their entirety to the SSD before uploading to blob storage.
+ * Files opened read-only are not downloaded here; blocks are fetched from the service as they are read (see azs_read.)
  *
  * @param  path The path to the file to open
  * @param  fi   File info.  Contains the flags to use in open().  May update the fh.
@@ -166,6 +996,7 @@ int azs_open(const char *path, struct fuse_file_info *fi);
 
 /**
  * Read data from the file (the blob) into the input buffer
+ * Any blocks in the range that have not yet been fetched into the file cache are downloaded first.
  * @param  path   Path of the file (blob) to read from
  * @param  buf    Buffer in which to copy the data
  * @param  size   Amount of data to copy
@@ -190,8 +1021,8 @@ int azs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
  * Write data to the file.
  *
  * Here, we are still just writing data to the local buffer, not forwarding to Storage.
- * TODO: possible in-memory caching?
- * TODO: for very large files, start uploading to Storage before all the data has been written here.
+ * Blocks of the file cached in memory don't need to be invalidated; the write changes the file's generation, so they are no longer looked up.
+ * For very large files written sequentially, the handle's write_behind uploads each block to Storage as soon as it has been written.
  * @param  path   Path to the file to write.
  * @param  buf    Buffer containing the data to write.
  * @param  size   Amount of data to write
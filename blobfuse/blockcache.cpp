@@ -0,0 +1,224 @@
+#include "blobfuse.h"
+#include <string.h>
+
+// Number of missed blocks remembered per shard, for deciding which blocks to promote.
+const size_t max_ghosts_per_shard = 4096;
+
+// With multiple FUSE threads, a sequential reader's requests can be processed slightly out of order; a miss this close to where the reader was expected to read next is still sequential.
+const unsigned long long sequential_slack = 1024*1024;
+
+std::shared_ptr<block_cache> block_cache::_instance;
+std::mutex block_cache::s_mutex;
+
+block_cache* block_cache::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new block_cache());
+        }
+    }
+    return _instance.get();
+}
+
+void block_cache::set_capacity(unsigned long long capacity)
+{
+    m_capacity = capacity;
+}
+
+ssize_t block_cache::read(unsigned long long id, unsigned long long generation, char *buf, size_t size, off_t offset)
+{
+    if (!enabled() || (size == 0))
+    {
+        return -1;
+    }
+
+    // Find every block first (holding references to them, so that they can't be freed by eviction), and only then copy.
+    size_t first = offset / cache_block_size;
+    size_t last = (offset + size - 1) / cache_block_size;
+    std::vector<std::shared_ptr<std::vector<char>>> blocks;
+    for (size_t index = first; index <= last; index++)
+    {
+        block_key key = {id, generation, index};
+        auto data = lookup(key);
+        if (!data)
+        {
+            return -1;
+        }
+        blocks.push_back(data);
+        if (data->size() < cache_block_size)
+        {
+            // This is the last block of the file.
+            break;
+        }
+    }
+
+    unsigned long long position = offset;
+    size_t copied = 0;
+    for (size_t i = 0; (i < blocks.size()) && (copied < size); i++)
+    {
+        unsigned long long block_start = (first + i) * cache_block_size;
+        unsigned long long block_end = block_start + blocks[i]->size();
+        if (position >= block_end)
+        {
+            break;
+        }
+        size_t count = std::min((unsigned long long)(size - copied), block_end - position);
+        memcpy(buf + copied, blocks[i]->data() + (position - block_start), count);
+        copied += count;
+        position += count;
+    }
+    return copied;
+}
+
+void block_cache::promote(unsigned long long id, unsigned long long generation, int fd, off_t offset, size_t size, const void *reader)
+{
+    if (!enabled() || (size == 0))
+    {
+        return;
+    }
+
+    size_t first = offset / cache_block_size;
+    size_t last = (offset + size - 1) / cache_block_size;
+    for (size_t index = first; index <= last; index++)
+    {
+        block_key key = {id, generation, index};
+        unsigned long long start = std::max((unsigned long long)offset, index * cache_block_size);
+        unsigned long long end = std::min((unsigned long long)offset + size, (index + 1) * cache_block_size);
+        if (!should_promote(key, reader, start, end))
+        {
+            continue;
+        }
+
+        auto data = std::make_shared<std::vector<char>>(cache_block_size);
+        size_t read = 0;
+        while (read < cache_block_size)
+        {
+            ssize_t res = pread(fd, data->data() + read, cache_block_size - read, index * cache_block_size + read);
+            if (res < 0)
+            {
+                return;
+            }
+            if (res == 0)
+            {
+                break;
+            }
+            read += res;
+        }
+        data->resize(read);
+        data->shrink_to_fit();
+        insert(key, data);
+    }
+}
+
+void block_cache::remove_file(unsigned long long id)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    block_key begin = {id, 0, 0};
+    block_key end = {id + 1, 0, 0};
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        shard &s = m_shards[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto iter = s.blocks.lower_bound(begin);
+        while ((iter != s.blocks.end()) && (iter->first < end))
+        {
+            s.size -= iter->second.data->size();
+            s.lru.erase(iter->second.lru_position);
+            iter = s.blocks.erase(iter);
+        }
+    }
+}
+
+block_cache::shard &block_cache::get_shard(const block_key &key)
+{
+    // Consecutive blocks of a file go to different shards, so that a large read doesn't contend on a single lock.
+    return m_shards[(key.id * 31 + key.index) % shard_count];
+}
+
+std::shared_ptr<std::vector<char>> block_cache::lookup(const block_key &key)
+{
+    shard &s = get_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto iter = s.blocks.find(key);
+    if (iter == s.blocks.end())
+    {
+        return std::shared_ptr<std::vector<char>>();
+    }
+    s.lru.splice(s.lru.begin(), s.lru, iter->second.lru_position);
+    return iter->second.data;
+}
+
+void block_cache::insert(const block_key &key, std::shared_ptr<std::vector<char>> data)
+{
+    shard &s = get_shard(key);
+    unsigned long long shard_capacity = m_capacity / shard_count;
+    if (data->size() > shard_capacity)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.blocks.find(key) != s.blocks.end())
+    {
+        return;
+    }
+    s.lru.push_front(key);
+    cached_block block;
+    block.data = data;
+    block.lru_position = s.lru.begin();
+    s.blocks[key] = block;
+    s.size += data->size();
+
+    // Evict the least recently used blocks.  They are still in the file cache on disk.
+    while (s.size > shard_capacity)
+    {
+        auto victim = s.blocks.find(s.lru.back());
+        s.size -= victim->second.data->size();
+        s.blocks.erase(victim);
+        s.lru.pop_back();
+    }
+}
+
+bool block_cache::should_promote(const block_key &key, const void *reader, unsigned long long start, unsigned long long end)
+{
+    shard &s = get_shard(key);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.blocks.find(key) != s.blocks.end())
+    {
+        return false;
+    }
+
+    auto ghost = s.ghosts.find(key);
+    if (ghost != s.ghosts.end())
+    {
+        // A reader that is still working its way sequentially through the block hasn't missed it again; it just hasn't finished reading it yet.
+        if ((ghost->second.reader == reader) && (start + sequential_slack >= ghost->second.next_offset) && (start <= ghost->second.next_offset + sequential_slack))
+        {
+            ghost->second.next_offset = std::max(ghost->second.next_offset, end);
+            return false;
+        }
+        s.ghost_lru.erase(ghost->second.lru_position);
+        s.ghosts.erase(ghost);
+        return true;
+    }
+
+    s.ghost_lru.push_front(key);
+    ghost_block ghost_entry;
+    ghost_entry.lru_position = s.ghost_lru.begin();
+    ghost_entry.reader = reader;
+    ghost_entry.next_offset = end;
+    s.ghosts[key] = ghost_entry;
+    if (s.ghosts.size() > max_ghosts_per_shard)
+    {
+        s.ghosts.erase(s.ghost_lru.back());
+        s.ghost_lru.pop_back();
+    }
+    return false;
+}
@@ -0,0 +1,201 @@
+#include "blobfuse.h"
+#include <fcntl.h>
+#include <atomic>
+#include <set>
+#include "base64.h"
+
+// Blocks larger than this are not uploaded again on their own; the whole file is uploaded instead.
+const unsigned long long max_reupload_block_size = 100*1024*1024;
+
+namespace {
+
+    struct block_upload
+    {
+        std::string id;
+        unsigned long long offset;
+        unsigned long long length;
+    };
+
+    // Returns true if [start, end) overlaps any of the (non-overlapping) ranges.
+    bool overlaps(const std::map<unsigned long long, unsigned long long> &ranges, unsigned long long start, unsigned long long end)
+    {
+        auto iter = ranges.lower_bound(end);
+        if (iter == ranges.begin())
+        {
+            return false;
+        }
+        --iter;
+        return iter->second > start;
+    }
+
+    // Generates block IDs that aren't used by any of the blob's existing blocks.  Every block ID of a blob must encode to the same length,
+    // so the new IDs are built to the length of the existing ones.  These are distinct from the IDs generated by upload_file_to_blob, which pads with 'a'.
+    class block_id_generator
+    {
+    public:
+        block_id_generator(const std::vector<get_block_list_item> &existing, size_t length) : m_length(length), m_next(0)
+        {
+            for (size_t i = 0; i < existing.size(); i++)
+            {
+                m_existing.insert(existing[i].name);
+            }
+        }
+
+        // Returns false if there is no unused ID of the required length.
+        bool next(std::string &id)
+        {
+            while (true)
+            {
+                std::string raw = std::to_string(m_next++);
+                if (raw.length() > m_length)
+                {
+                    return false;
+                }
+                raw = std::string(m_length - raw.length(), 'b').append(raw);
+                id = to_base64(std::vector<unsigned char>(raw.begin(), raw.end()));
+                if (m_existing.insert(id).second)
+                {
+                    return true;
+                }
+            }
+        }
+
+    private:
+        std::set<std::string> m_existing;
+        size_t m_length;
+        unsigned long long m_next;
+    };
+
+    int upload_block(int fd, const std::string &blob, const block_upload &block)
+    {
+        errno = 0;
+        azure_blob_client_wrapper->upload_block_from_source(str_options.containerName, blob, block.id, std::make_shared<storage_fd_source>(fd, block.offset, block.length));
+        return errno;
+    }
+}
+
+bool upload_modified_blocks(const std::string &mntPath, const std::string &blob, unsigned long long size, const std::map<unsigned long long, unsigned long long> &modified_ranges, const std::string &etag, std::string &new_etag)
+{
+    if (etag.empty())
+    {
+        return false;
+    }
+
+    // The rest of the file in the cache is only known to match the blob if the blob hasn't changed since we last saw it.
+    errno = 0;
+    auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, blob);
+    if ((errno != 0) || !blob_property.valid() || (blob_property.etag != etag) || (size < blob_property.size))
+    {
+        return false;
+    }
+
+    errno = 0;
+    auto block_list_response = azure_blob_client_wrapper->get_block_list(str_options.containerName, blob);
+    const std::vector<get_block_list_item> &committed = block_list_response.committed;
+    if ((errno != 0) || committed.empty())
+    {
+        // The blob was uploaded with a single Put Blob, so it has no blocks to reuse.
+        return false;
+    }
+
+    block_id_generator generator(committed, from_base64(committed[0].name).size());
+    std::vector<put_block_list_request_base::block_item> block_list;
+    std::vector<block_upload> uploads;
+    unsigned long long offset = 0;
+    for (size_t i = 0; i < committed.size(); i++)
+    {
+        put_block_list_request_base::block_item item;
+        unsigned long long end = offset + committed[i].size;
+        if (overlaps(modified_ranges, offset, end))
+        {
+            block_upload upload;
+            if ((committed[i].size > max_reupload_block_size) || !generator.next(upload.id))
+            {
+                return false;
+            }
+            upload.offset = offset;
+            upload.length = committed[i].size;
+            uploads.push_back(upload);
+            item.id = upload.id;
+            item.type = put_block_list_request_base::block_type::uncommitted;
+        }
+        else
+        {
+            item.id = committed[i].name;
+            item.type = put_block_list_request_base::block_type::committed;
+        }
+        block_list.push_back(item);
+        offset = end;
+    }
+    if (offset != blob_property.size)
+    {
+        return false;
+    }
+
+    // Anything written past the old end of the blob goes in new blocks.
+    for (; offset < size; offset += cache_block_size)
+    {
+        block_upload upload;
+        if (!generator.next(upload.id))
+        {
+            return false;
+        }
+        upload.offset = offset;
+        upload.length = std::min(cache_block_size, size - offset);
+        uploads.push_back(upload);
+
+        put_block_list_request_base::block_item item;
+        item.id = upload.id;
+        item.type = put_block_list_request_base::block_type::uncommitted;
+        block_list.push_back(item);
+    }
+    if (block_list.size() > max_block_count)
+    {
+        return false;
+    }
+
+    if (AZS_PRINT)
+    {
+        fprintf(stdout, "Uploading %lu of %lu blocks of blob %s\n", uploads.size(), block_list.size(), blob.c_str());
+    }
+
+    int fd = open(mntPath.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    std::atomic<size_t> next_upload(0);
+    std::atomic<bool> failed(false);
+    auto worker = [fd, &blob, &uploads, &next_upload, &failed]()
+    {
+        size_t index;
+        while (!failed.load() && ((index = next_upload++) < uploads.size()))
+        {
+            if (upload_block(fd, blob, uploads[index]) != 0)
+            {
+                failed = true;
+            }
+        }
+    };
+    size_t worker_count = std::min(uploads.size(), (size_t)upload_parallelism);
+    std::vector<std::future<void>> workers;
+    for (size_t i = 1; i < worker_count; i++)
+    {
+        workers.push_back(std::async(std::launch::async, worker));
+    }
+    worker();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].wait();
+    }
+    close(fd);
+    if (failed.load())
+    {
+        return false;
+    }
+
+    // If the blob was changed after we got its block list, this fails with 412 (Precondition Failed), and the whole file is uploaded instead.
+    errno = 0;
+    new_etag = azure_blob_client_wrapper->put_block_list(str_options.containerName, blob, block_list, std::vector<std::pair<std::string, std::string>>(), etag);
+    return errno == 0;
+}
@@ -16,6 +16,8 @@ int azs_mkdir(const char *path, mode_t)
     std::vector<std::pair<std::string, std::string>> metadata;
     errno = 0;
     azure_blob_client_wrapper->upload_block_blob_from_stream(str_options.containerName, pathstr.substr(1), emptyDataStream, metadata);
+    attr_cache::get_instance()->invalidate(path);
+    listing_cache::get_instance()->invalidate_parent(path);
     if (errno != 0)
     {
         return 0 - map_errno(errno);
@@ -23,23 +25,152 @@ int azs_mkdir(const char *path, mode_t)
     return 0;
 }
 
-/**
- * Read the contents of a directory.  For each entry to add, call the filler function with the input buffer,
- * the name of the entry, and additional data about the entry.  TODO: Keep the data (somehow) for latter getattr calls.
- *
- * @param  path   Path to the directory to read.
- * @param  buf    Buffer to pass into the filler function.  Not otherwise used in this function.
- * @param  filler Function to call to add directories and files as they are discovered.
- * @param  offset Not used
- * @param  fi     File info about the directory to be read.
- * @param  flags  Not used.  TODO: Consider prefetching on FUSE_READDIR_PLUS.
- * @return        TODO: error codes.
- */
-int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *)
+// Parses the blobs and directories in a page of the listing of the directory into its entries, and caches their attributes.
+static void parse_page(const std::string &pathStr, const std::vector<list_blobs_hierarchical_item> &items, std::vector<dir_entry> &entries)
+{
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        // We need to parse out just the trailing part of the path name.
+        if (items[i].name.size() < pathStr.size())
+        {
+            continue;
+        }
+        std::string prev_token_str;
+        if (items[i].name.back() == '/')
+        {
+            prev_token_str = items[i].name.substr(pathStr.size() - 1, items[i].name.size() - pathStr.size());
+        }
+        else
+        {
+            prev_token_str = items[i].name.substr(pathStr.size() - 1);
+        }
+        if (prev_token_str.size() == 0)
+        {
+            continue;
+        }
+
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+        if (!items[i].is_directory)
+        {
+            if (strcmp(prev_token_str.c_str(), directorySignifier.c_str()) == 0)
+            {
+                continue;
+            }
+            stbuf.st_mode = S_IFREG | 0770; // Regular file (not a directory)
+            stbuf.st_nlink = 1;
+            stbuf.st_size = items[i].content_length;
+        }
+        else
+        {
+            // The listing doesn't tell us whether the directory is empty (it may hold only its ".directory" blob), so it's reported
+            // as not empty, as azs_getattr() would report it; an empty directory reported as non-empty is harmless, the reverse is not.
+            stbuf.st_mode = S_IFDIR | 0770;
+            stbuf.st_nlink = 3;
+            stbuf.st_size = 4096;
+        }
+        attr_cache::get_instance()->put(pathStr + prev_token_str, stbuf, items[i].etag);
+        entries.push_back(std::make_pair(prev_token_str, stbuf));
+    }
+}
+
+int fetch_next_page(struct dirhandle *dh)
+{
+    list_retry retry;
+    while (true)
+    {
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "About to call list_blobs_hierarchial.  Container = %s, continuation = %s, prefix = %s\n", str_options.containerName.c_str(), dh->continuation.c_str(), dh->prefix.c_str());
+        }
+
+        errno = 0;
+        list_blobs_hierarchical_response response;
+        if (dh->sharded)
+        {
+            // The sharded listing has done its own retries.  It returns an empty page once it's complete.
+            int ret = dh->sharded->next_page(response.blobs);
+            if (ret != 0)
+            {
+                return ret;
+            }
+            response.next_marker = response.blobs.empty() ? std::string() : dh->continuation;
+        }
+        else
+        {
+            response = azure_blob_client_wrapper->list_blobs_hierarchical(str_options.containerName, "/", dh->continuation, dh->prefix);
+        }
+        if (errno == 0)
+        {
+            // A page may start with the blob that the previous page ended with.
+            std::vector<list_blobs_hierarchical_item> &items = response.blobs;
+            if (!items.empty() && (items[0].name == dh->prior))
+            {
+                items.erase(items.begin());
+            }
+            // The page has the blobs first, then the subdirectories; the listing continues after the greatest name in it.
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                dh->prior = std::max(dh->prior, items[i].name);
+            }
+
+            auto page = std::make_shared<std::vector<dir_entry>>();
+            parse_page(dh->path, items, *page);
+            if (dh->listing)
+            {
+                if (dh->listing->size() + page->size() <= max_cached_listing_size)
+                {
+                    dh->listing->insert(dh->listing->end(), page->begin(), page->end());
+                }
+                else
+                {
+                    dh->listing.reset();
+                }
+            }
+
+            if (dh->prefetch_subdirectories)
+            {
+                std::vector<std::string> subdirectories;
+                for (size_t i = 0; i < page->size(); i++)
+                {
+                    if (S_ISDIR((*page)[i].second.st_mode))
+                    {
+                        subdirectories.push_back(dh->path + (*page)[i].first + "/");
+                    }
+                }
+                listing_prefetcher::get_instance()->enqueue(subdirectories);
+            }
+
+            dh->page_offset += dh->page->size();
+            dh->page = page;
+            dh->continuation = response.next_marker;
+            if (!dh->listing_started && !dh->continuation.empty() && (list_parallelism > 1))
+            {
+                // The directory is large; list the rest of it concurrently.
+                dh->sharded.reset(new sharded_listing(str_options.containerName, dh->prefix, dh->prior, dh->continuation, list_parallelism));
+            }
+            dh->listing_started = true;
+            return 0;
+        }
+
+        int error = errno;
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "list_blobs_hierarchical failed with errno = %d\n", error);
+        }
+        int ret = retry.wait(error);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+}
+
+int azs_opendir(const char *path, struct fuse_file_info *fi)
 {
     if (AZS_PRINT)
     {
-        fprintf(stdout, "azs_readdir called with path = %s\n", path);
+        fprintf(stdout, "azs_opendir called with path = %s\n", path);
     }
     std::string pathStr(path);
     if (pathStr.size() > 1)
@@ -47,7 +178,8 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
         pathStr.push_back('/');
     }
 
-    std::vector<std::string> local_list_results;
+    struct dirhandle *dh = new dirhandle(pathStr);
+    dh->prefetch_subdirectories = true;
 
     // Scan for any files that exist in the local cache.
     // It is possible that there are files in the cache that aren't on the service - if a file has been opened but not yet uplaoded, for example.
@@ -60,28 +192,27 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
         {
             if (dir_ent->d_name[0] != '.')
             {
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(stbuf));
                 if (dir_ent->d_type == DT_DIR)
                 {
-                    struct stat stbuf;
                     stbuf.st_mode = S_IFDIR | 0770;
                     stbuf.st_nlink = 2;
                     stbuf.st_size = 4096;
-                    filler(buf, dir_ent->d_name, &stbuf, 0);
                 }
                 else
                 {
                     struct stat buffer;
                     stat((mntPathString + dir_ent->d_name).c_str(), &buffer);
 
-                    struct stat stbuf;
                     stbuf.st_mode = S_IFREG | 0770; // Regular file (not a directory)
                     stbuf.st_nlink = 1;
                     stbuf.st_size = buffer.st_size;
-                    filler(buf, dir_ent->d_name, &stbuf, 0); // TODO: Add stat information.  Consider FUSE_FILL_DIR_PLUS.
                 }
 
                 std::string dir_str(dir_ent->d_name);
-                local_list_results.push_back(dir_str);
+                dh->local_entries.push_back(std::make_pair(dir_str, stbuf));
+                dh->local_names.insert(dir_str);
 
                 if (AZS_PRINT)
                 {
@@ -94,76 +225,140 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
         closedir(dir_stream);
     }
 
-    errno = 0;
-    std::vector<list_blobs_hierarchical_item> listResults = list_all_blobs_hierarchical(str_options.containerName, "/", pathStr.substr(1));
-    if (errno != 0)
+    dh->page_offset = 2 + dh->local_entries.size();
+    auto cached_listing = listing_cache::get_instance()->get(pathStr);
+    if (cached_listing)
     {
         if (AZS_PRINT)
         {
-            fprintf(stdout, "azs_readdir list blobs failed with error = %d\n", errno);
+            fprintf(stdout, "Using cached listing of %s, %lu entries\n", pathStr.c_str(), cached_listing->size());
         }
-        return 0 - map_errno(errno);
+        dh->page = cached_listing;
+        dh->listing_started = true;
     }
+    else
+    {
+        dh->listing = std::make_shared<std::vector<dir_entry>>();
+        dh->listing_generation = listing_cache::get_instance()->get_generation();
+    }
+    fi->fh = (long unsigned int)dh;
+    return 0;
+}
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
+/**
+ * Read the contents of a directory.  For each entry to add, call the filler function with the input buffer,
+ * the name of the entry, and additional data about the entry.  The attributes of the entries found on the service are also kept
+ * in the attribute cache, for later getattr calls.
+ *
+ * Entries are numbered: "." and "..", then the entries found in the local cache by azs_opendir(), then the blobs and directories on the service,
+ * in listing order.  Each entry is passed to the filler with the number of the entry after it, and when the filler's buffer is full, FUSE calls
+ * again with that number as the offset.  The listing is fetched one page at a time, as the reader gets to it, and only the current page is kept,
+ * along with the listing so far, for the listing cache, if the directory is small enough to cache.  If the directory's listing was cached, it's read from that instead.
+ *
+ * @param  path   Path to the directory to read.
+ * @param  buf    Buffer to pass into the filler function.  Not otherwise used in this function.
+ * @param  filler Function to call to add directories and files as they are discovered.
+ * @param  offset Number of the entry to start from.
+ * @param  fi     File info about the directory to be read.  Its fh is the dirhandle from azs_opendir().
+ * @return        0 on success, or -errno if listing the directory failed.
+ */
+int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
     if (AZS_PRINT)
     {
-        fprintf(stdout, "result count = %lu\n", listResults.size());
+        fprintf(stdout, "azs_readdir called with path = %s, offset = %ld\n", path, offset);
     }
-    for (size_t i = 0; i < listResults.size(); i++)
+    struct dirhandle *dh = (struct dirhandle *)fi->fh;
+    std::lock_guard<std::mutex> lock(dh->mutex);
+
+    off_t position = offset;
+    if (position == 0)
     {
-        int fillerResult;
-        // We need to parse out just the trailing part of the path name.
-        int len = listResults[i].name.size();
-        if (len > 0)
+        if (filler(buf, ".", NULL, 1))
         {
-            std::string prev_token_str;
-            if (listResults[i].name.back() == '/')
-            {
-                prev_token_str = listResults[i].name.substr(pathStr.size() - 1, listResults[i].name.size() - pathStr.size());
-            }
-            else
-            {
-                prev_token_str = listResults[i].name.substr(pathStr.size() - 1);
-            }
+            return 0;
+        }
+        position++;
+    }
+    if (position == 1)
+    {
+        if (filler(buf, "..", NULL, 2))
+        {
+            return 0;
+        }
+        position++;
+    }
+    off_t local_end = 2 + dh->local_entries.size();
+    for (; position < local_end; position++)
+    {
+        const dir_entry &entry = dh->local_entries[position - 2];
+        if (filler(buf, entry.first.c_str(), &entry.second, position + 1))
+        {
+            return 0;
+        }
+    }
 
-            // Any files that exist both on the service and in the local cache will be in both lists, we need to de-dup them.
-            // TODO: order or hash the list to improve perf
-            if (std::find(local_list_results.begin(), local_list_results.end(), prev_token_str) == local_list_results.end())
+    // The reader went back to a page we no longer have (by rewinding the directory); list the directory again from the start.
+    if (position < dh->page_offset)
+    {
+        dh->page = std::make_shared<std::vector<dir_entry>>();
+        dh->page_offset = local_end;
+        dh->continuation.clear();
+        dh->prior.clear();
+        dh->listing_started = false;
+        dh->sharded.reset();
+        dh->listing = std::make_shared<std::vector<dir_entry>>();
+        dh->listing_generation = listing_cache::get_instance()->get_generation();
+    }
+
+    while (true)
+    {
+        if (position >= dh->page_offset + (off_t)dh->page->size())
+        {
+            if (dh->listing_started && dh->continuation.empty())
             {
-                if (!listResults[i].is_directory)
+                // That's the whole listing.
+                if (dh->listing)
                 {
-                    if ((prev_token_str.size() > 0) && (strcmp(prev_token_str.c_str(), directorySignifier.c_str()) != 0))
-                    {
-                        struct stat stbuf;
-                        stbuf.st_mode = S_IFREG | 0770; // Regular file (not a directory)
-                        stbuf.st_nlink = 1;
-                        stbuf.st_size = listResults[i].content_length;
-                        fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0); // TODO: Add stat information.  Consider FUSE_FILL_DIR_PLUS.
-                        if (AZS_PRINT)
-                        {
-                            fprintf(stdout, "blob result = %s, fillerResult = %d\n", prev_token_str.c_str(), fillerResult);
-                        }
-                    }
+                    listing_cache::get_instance()->put(dh->path, dh->listing, dh->listing_generation);
+                    dh->listing.reset();
                 }
-                else
+                break;
+            }
+            int ret = fetch_next_page(dh);
+            if (ret != 0)
+            {
+                if (AZS_PRINT)
                 {
-                    if (prev_token_str.size() > 0)
-                    {
-                        struct stat stbuf;
-                        stbuf.st_mode = S_IFDIR | 0770;
-                        stbuf.st_nlink = 2;
-                        fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0);
-                        if (AZS_PRINT)
-                        {
-                            fprintf(stdout, "dir result = %s, fillerResult = %d\n", prev_token_str.c_str(), fillerResult);
-                        }
-                    }
-
+                    fprintf(stdout, "azs_readdir list blobs failed with error = %d\n", ret);
                 }
+                return 0 - map_errno(ret);
+            }
+            if (AZS_PRINT)
+            {
+                fprintf(stdout, "result count = %lu\n", dh->page->size());
             }
+            continue;
+        }
+
+        const dir_entry &entry = (*dh->page)[position - dh->page_offset];
+        position++;
+
+        // Any files that exist both on the service and in the local cache will be in both lists, we need to de-dup them.
+        if (dh->local_names.find(entry.first) != dh->local_names.end())
+        {
+            continue;
+        }
+
+        int fillerResult = filler(buf, entry.first.c_str(), &entry.second, position);
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "%s result = %s, fillerResult = %d\n", S_ISDIR(entry.second.st_mode) ? "dir" : "blob", entry.first.c_str(), fillerResult);
+        }
+        if (fillerResult != 0)
+        {
+            // The buffer is full; FUSE will call again, starting from this entry.
+            return 0;
         }
     }
     if (AZS_PRINT)
@@ -173,6 +368,16 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
     return 0;
 }
 
+int azs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    if (AZS_PRINT)
+    {
+        fprintf(stdout, "azs_releasedir called with path = %s\n", path);
+    }
+    delete (struct dirhandle *)fi->fh;
+    return 0;
+}
+
 int azs_rmdir(const char *path)
 {
     if (AZS_PRINT)
@@ -213,6 +418,9 @@ int azs_rmdir(const char *path)
 
     pathStr.append(".directory");
     azs_unlink(pathStr.c_str());
+    attr_cache::get_instance()->invalidate(path);
+    listing_cache::get_instance()->invalidate_parent(path);
+    listing_cache::get_instance()->invalidate_tree(path);
 
     return 0;
 }
@@ -64,6 +64,39 @@ private:
 std::shared_ptr<file_lock_map> file_lock_map::_instance;
 std::mutex file_lock_map::s_mutex;
 
+// Checks, with a HEAD request, whether the blob still has the ETag it had when the file in the cache was last known to match it.
+// If it does, the file's modified time (from which the cache timeout is measured) is reset to now, and true is returned.
+// This is only sound if the recorded ETag is exactly that of the version in the cache: azs_flush() takes it from the upload's own response, and downloads
+// are conditional on it, so another client's write can never be attributed to the file in the cache.
+static bool revalidate_cached_file(const std::string &pathString, const char *mntPath, std::shared_ptr<file_cache_entry> cache_entry)
+{
+    std::string etag = cache_entry->get_etag();
+    if (etag.empty())
+    {
+        return false;
+    }
+
+    errno = 0;
+    auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, pathString.substr(1));
+    if ((errno != 0) || !blob_property.valid() || (blob_property.etag != etag))
+    {
+        return false;
+    }
+
+    time_t now = time(NULL);
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = now;
+    times[1].tv_nsec = 0;
+    if (utimensat(AT_FDCWD, mntPath, times, 0) != 0)
+    {
+        return false;
+    }
+    cache_entry->set_mtime(now);
+    return true;
+}
+
 // Opens a file for reading or writing
 // Behavior is defined by a normal, open() system call.
 // In all methods in this file, the variables "path" and "pathString" refer to the input path - the path as seen by the application using FUSE as a file system.
@@ -84,11 +117,39 @@ int azs_open(const char *path, struct fuse_file_info *fi)
     auto fmutex = file_lock_map::get_instance()->get_mutex(path);
     std::lock_guard<std::mutex> lock(*fmutex);
 
+    // Files opened read-only are fetched from the service on demand, as they are read.  Files opened for writing must be cached in full, so that they can be uploaded on flush().
+    bool read_only = ((fi->flags & O_ACCMODE) == O_RDONLY);
+    auto cache_entry = file_cache_map::get_instance()->get_entry(pathString);
+
     // If the file/blob being opened does not exist in the cache, or the version in the cache is too old, we need to download / refresh the data from the service.
+    // A file that is too old is kept, though, if the blob hasn't changed since.
+    // A partial file whose blob changed on the service while it was being fetched is always replaced.
     struct stat buf;
     int statret = stat(mntPath, &buf);
-    if ((statret != 0) || ((time(NULL) - buf.st_mtime) > file_cache_timeout_in_seconds))  // TODO: Consider using "modified time" here, rather than "access time".
+    bool expired = (statret == 0) && ((time(NULL) - buf.st_mtime) > file_cache_timeout_in_seconds);  // TODO: Consider using "modified time" here, rather than "access time".
+    bool stale = (statret == 0) && cache_entry->is_stale();
+    if (expired && !stale && revalidate_cached_file(pathString, mntPath, cache_entry))
+    {
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "Blob %s has not changed, keeping the file in the cache.\n", pathString.c_str());
+        }
+    }
+    else if ((statret != 0) || expired || stale)
     {
+        // Get the size of the blob before we remove the current version of the file from the cache.
+        errno = 0;
+        auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, pathString.substr(1));
+        if (errno != 0)
+        {
+            return 0 - map_errno(errno);
+        }
+        if (!blob_property.valid())
+        {
+            return -ENOENT;
+        }
+        unsigned long long blob_size = blob_property.size;
+
         remove(mntPath);
 
         if(0 != ensure_files_directory_exists_in_cache(mntPathString))
@@ -96,9 +157,8 @@ int azs_open(const char *path, struct fuse_file_info *fi)
             fprintf(stderr, "Failed to create file or direcotry on cache directory: %s, errno = %d.\n", mntPathString.c_str(),  errno);
             return -1;
         }
-        std::ofstream filestream(mntPathString, std::ofstream::binary | std::ofstream::out);
         errno = 0;
-        int fd = open(mntPath, O_WRONLY);
+        int fd = open(mntPath, O_WRONLY|O_CREAT|O_TRUNC, 0770);
         if (fd == -1)
         {
             return -errno;
@@ -115,6 +175,7 @@ int azs_open(const char *path, struct fuse_file_info *fi)
             {
                 // Someone else holds the lock.  In this case, we will postpone updating the cache until the next time open() is called.
                 // TODO: examine the possibility that we can never acquire the lock and refresh the cache.
+                close(fd);
             }
             else
             {
@@ -126,30 +187,81 @@ int azs_open(const char *path, struct fuse_file_info *fi)
         }
         else
         {
-            // We have the exclusive lock on the file, we are safe to download it from the service.
+            // We have the exclusive lock on the file.  We size the file in the cache to match the blob, and track which blocks of it have been fetched.
+            // The file in the cache is a new file, so any handles still open to the prior version keep using the prior cache entry.
             errno = 0;
-            azure_blob_client_wrapper->download_blob_to_stream(str_options.containerName, pathString.substr(1), 0ULL, 1000000000000ULL, filestream);
-            int storage_errno = errno;
-            flock(fd, LOCK_UN);
-            close(fd);
-            if (storage_errno != 0)
+            int truncret = ftruncate(fd, blob_size);
+            int truncerrno = errno;
+            struct stat newbuf;
+            if ((truncret == 0) && (fstat(fd, &newbuf) != 0))
             {
+                truncret = -1;
+                truncerrno = errno;
+            }
+            if (truncret != 0)
+            {
+                flock(fd, LOCK_UN);
+                close(fd);
                 remove(mntPath);
-                return 0 - map_errno(storage_errno);
+                return -truncerrno;
             }
-            if (errno != 0)
+            cache_entry = file_cache_map::get_instance()->reset_entry(pathString);
+            cache_entry->set_etag(blob_property.etag);
+
+            int fetchret = 0;
+            if (read_only)
             {
-                return -errno;
+                // Rather than downloading the blob, let azs_read() fetch the blocks that are actually read.
+                if (blob_size > 0)
+                {
+                    cache_entry->init_partial(blob_size, newbuf.st_mtime, cache_block_size);
+                }
+            }
+            else if (blob_size > 0)
+            {
+                // The whole blob is needed.  Download it in ranges, over several connections at once.
+                cache_entry->init_partial(blob_size, newbuf.st_mtime, download_range_size);
+                fetchret = cache_entry->fetch_all(fd, download_parallelism);
+            }
+            flock(fd, LOCK_UN);
+            close(fd);
+            if (fetchret != 0)
+            {
+                remove(mntPath);
+                file_cache_map::get_instance()->remove_entry(pathString);
+                return fetchret;
             }
         }
     }
+    else if (!read_only && !cache_entry->is_complete())
+    {
+        // The file was previously opened read-only, and only some of its blocks have been fetched.  Fetch the rest before it can be written to.
+        errno = 0;
+        int fd = open(mntPath, O_WRONLY);
+        if (fd == -1)
+        {
+            return -errno;
+        }
+        int fetchret = cache_entry->fetch_all(fd, download_parallelism);
+        close(fd);
+        if (fetchret != 0)
+        {
+            return fetchret;
+        }
+    }
 
     errno = 0;
     int res;
 
     // Open a file handle to the file in the cache.
     // This will be stored in 'fi', and used for later read/write operations.
-    res = open(mntPath, fi->flags);
+    // If the file is partial, blocks fetched on read are written through this handle, so it must be opened for writing as well.
+    int open_flags = fi->flags;
+    if (read_only && !cache_entry->is_complete())
+    {
+        open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+    }
+    res = open(mntPath, open_flags);
     if (AZS_PRINT)
     {
         printf("Accessing %s gives res = %d, errno = %d, ENOENT = %d, processID = %d\n", mntPath, res, errno, ENOENT, getpid());
@@ -191,9 +303,25 @@ int azs_open(const char *path, struct fuse_file_info *fi)
     // TODO: Actual access control
     fchmod(res, 0770);
 
-    // Store the open file handle, and whether or not the file should be uploaded on close().
-    // TODO: Optimize the scenario where the file is open for read/write, but no actual writing occurs, to not upload the blob.
-    struct fhwrapper *fhwrap = new fhwrapper(res, (((fi->flags & O_WRONLY) == O_WRONLY) || ((fi->flags & O_RDWR) == O_RDWR)));
+    // Store the open file handle, and whether or not the file may need to be uploaded on close().
+    // Whether it actually is uploaded depends on whether the file is modified; see azs_flush.
+    struct fhwrapper *fhwrap = new fhwrapper(res, (((fi->flags & O_WRONLY) == O_WRONLY) || ((fi->flags & O_RDWR) == O_RDWR)), cache_entry);
+    cache_entry->add_handle();
+    if (read_only && !cache_entry->is_complete())
+    {
+        fhwrap->readahead.reset(new readahead_state(cache_entry, res));
+    }
+    if (fhwrap->upload)
+    {
+        unsigned long long writer_epoch = cache_entry->add_writer();
+
+        // If the file is empty (newly truncated), the handle may well be about to write the whole file sequentially.
+        struct stat buf;
+        if ((fstat(res, &buf) == 0) && (buf.st_size == 0))
+        {
+            fhwrap->writer.reset(new write_behind(cache_entry, writer_epoch, mntPathString));
+        }
+    }
     fi->fh = (long unsigned int)fhwrap; // Store the file handle for later use.
 //    }
     return 0;
@@ -212,12 +340,53 @@ int azs_open(const char *path, struct fuse_file_info *fi)
  */
 int azs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int fd = ((struct fhwrapper *)fi->fh)->fh;
+    struct fhwrapper *fhwrap = (struct fhwrapper *)fi->fh;
+    int fd = fhwrap->fh;
+    if (fhwrap->cache_entry)
+    {
+        fhwrap->cache_entry->touch();
+    }
+
+    // Serve the read from memory if we can.  The generation is read before the file is, so that blocks promoted below are tagged with a generation no newer than their contents.
+    block_cache *memory_cache = block_cache::get_instance();
+    unsigned long long generation = 0;
+    if (memory_cache->enabled())
+    {
+        generation = fhwrap->cache_entry->get_generation();
+        ssize_t cached = memory_cache->read(fhwrap->cache_entry->get_id(), generation, buf, size, offset);
+        if (cached >= 0)
+        {
+            return cached;
+        }
+    }
+
+    // Let the handle's readahead see the read first, so that prefetching of the following blocks overlaps with fetching this one.
+    if (fhwrap->readahead)
+    {
+        fhwrap->readahead->on_read(offset, size);
+    }
+
+    // If the file in the cache is partial, fetch any blocks in the range being read that we don't have yet.
+    if (fhwrap->cache_entry)
+    {
+        int fetchret = fhwrap->cache_entry->ensure_range(fd, offset, size);
+        if (fetchret != 0)
+        {
+            return fetchret;
+        }
+    }
 
     errno = 0;
     int res = pread(fd, buf, size, offset);
     if (res == -1)
+    {
         res = -errno;
+    }
+    else if (memory_cache->enabled())
+    {
+        // ensure_range() above fetched whole blocks, so the blocks being promoted are fully present in the cache file.
+        memory_cache->promote(fhwrap->cache_entry->get_id(), generation, fd, offset, res, fhwrap);
+    }
 
     return res;
 }
@@ -281,7 +450,14 @@ int azs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
         return -errno;
     }
 
-    struct fhwrapper *fhwrap = new fhwrapper(res, true);
+    // The file was created locally, so the file in the cache is complete.  It doesn't exist on the service yet, so it must be uploaded on flush even if nothing is written to it.
+    auto cache_entry = file_cache_map::get_instance()->reset_entry(pathString);
+    cache_entry->mark_modified();
+    attr_cache::get_instance()->invalidate(pathString);
+    listing_cache::get_instance()->invalidate_parent(pathString);
+    struct fhwrapper *fhwrap = new fhwrapper(res, true, cache_entry);
+    cache_entry->add_handle();
+    fhwrap->writer.reset(new write_behind(cache_entry, cache_entry->add_writer(), mntPathString));
     fi->fh = (long unsigned int)fhwrap;
     return 0;
 }
@@ -291,8 +467,8 @@ int azs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  * Write data to the file.
  *
  * Here, we are still just writing data to the local buffer, not forwarding to Storage.
- * TODO: possible in-memory caching?
- * TODO: for very large files, start uploading to Storage before all the data has been written here.
+ * Blocks of the file cached in memory don't need to be invalidated; the write changes the file's generation, so they are no longer looked up.
+ * For very large files written sequentially, the handle's write_behind uploads each block to Storage as soon as it has been written.
  * @param  path   Path to the file to write.
  * @param  buf    Buffer containing the data to write.
  * @param  size   Amount of data to write
@@ -302,12 +478,24 @@ int azs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */
 int azs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int fd = ((struct fhwrapper *)fi->fh)->fh;
+    struct fhwrapper *fhwrap = (struct fhwrapper *)fi->fh;
+    int fd = fhwrap->fh;
 
     errno = 0;
     int res = pwrite(fd, buf, size, offset);
     if (res == -1)
+    {
         res = -errno;
+    }
+    else
+    {
+        fhwrap->cache_entry->mark_modified(offset, res);
+        fhwrap->cache_entry->touch();
+        if (fhwrap->writer)
+        {
+            fhwrap->writer->on_write(offset, res);
+        }
+    }
 
     return res;
 }
@@ -392,16 +580,47 @@ int azs_flush(const char *path, struct fuse_file_info *fi)
                 }
             }
 
-            // TODO: This will currently upload the full file on every flush() call.  We may want to keep track of whether
-            // or not flush() has been called already, and not re-upload the file each time.
-            std::vector<std::pair<std::string, std::string>> metadata;
-            errno = 0;
-            azure_blob_client_wrapper->upload_file_to_blob(mntPath, str_options.containerName, mntPathString.substr(str_options.tmpPath.size() + 6 /* there are six characters in "/root/" */), metadata, 8);
-            if (errno != 0)
+            // Only upload the file if it has been modified (through any handle) since it was last uploaded.
+            // The generation is read before the upload starts, so that writes that race with the upload are uploaded again by a later flush.
+            struct fhwrapper *fhwrap = (struct fhwrapper *)fi->fh;
+            unsigned long long generation = fhwrap->cache_entry->get_generation();
+            if (!fhwrap->cache_entry->is_modified())
             {
+                if (AZS_PRINT)
+                {
+                    fprintf(stdout, "Skipped blob upload because file has not been modified since it was last uploaded.\n");
+                }
                 free(path_buffer);
-                return 0 - map_errno(errno);
+                return 0;
+            }
+
+            std::string blob = mntPathString.substr(str_options.tmpPath.size() + 6 /* there are six characters in "/root/" */);
+
+            // If the blocks of the file have already been uploaded as they were written, all that's left is to commit them.
+            // Otherwise, if only some of a large file has changed, only upload the blocks of the blob that changed.
+            // Each way of uploading gives back the blob's new ETag.  This lets azs_open() keep the file in the cache when it times out, if the blob hasn't changed since,
+            // and lets the next upload of the file be partial.
+            std::map<unsigned long long, unsigned long long> modified_ranges;
+            std::string etag;
+            bool uploaded = (fhwrap->writer && fhwrap->writer->commit(blob, buf.st_size, etag))
+                || ((buf.st_size > (off_t)single_upload_threshold)
+                    && fhwrap->cache_entry->get_modified_ranges(modified_ranges)
+                    && upload_modified_blocks(mntPathString, blob, buf.st_size, modified_ranges, fhwrap->cache_entry->get_etag(), etag));
+            if (!uploaded)
+            {
+                std::vector<std::pair<std::string, std::string>> metadata;
+                errno = 0;
+                etag = azure_blob_client_wrapper->upload_file_to_blob(mntPath, str_options.containerName, blob, metadata, upload_parallelism);
+                if (errno != 0)
+                {
+                    free(path_buffer);
+                    return 0 - map_errno(errno);
+                }
             }
+            fhwrap->cache_entry->mark_uploaded(generation);
+            fhwrap->cache_entry->set_etag(etag);
+            attr_cache::get_instance()->invalidate("/" + blob);
+            listing_cache::get_instance()->invalidate_parent("/" + blob);
         }
     }
     else
@@ -432,6 +651,14 @@ int azs_release(const char *path, struct fuse_file_info * fi)
     {
         fprintf(stdout, "Now accessing %s.\n", mntPath);
     }
+    // Readahead writes through this handle, so it must be stopped before the handle is closed.
+    struct fhwrapper *fhwrap = (struct fhwrapper *)fi->fh;
+    fhwrap->readahead.reset();
+    fhwrap->writer.reset();
+    if (fhwrap->upload && fhwrap->cache_entry)
+    {
+        fhwrap->cache_entry->remove_writer();
+    }
     if (access(mntPath, F_OK) != -1 )
     {
         // Unlock the file and close the file handle.
@@ -447,10 +674,33 @@ int azs_release(const char *path, struct fuse_file_info * fi)
             fprintf(stdout, "Access failed.\n");
         }
     }
+    if (fhwrap->cache_entry)
+    {
+        fhwrap->cache_entry->remove_handle();
+    }
     delete (struct fhwrapper *)fi->fh;
     return 0;
 }
 
+bool evict_from_cache(const std::string path)
+{
+    // Holding the mutex guarantees that the file isn't being opened (and so isn't about to get a handle) while we check and remove it.
+    auto fmutex = file_lock_map::get_instance()->get_mutex(path);
+    std::lock_guard<std::mutex> lock(*fmutex);
+
+    auto cache_entry = file_cache_map::get_instance()->get_entry(path);
+    if (!cache_entry->is_evictable())
+    {
+        return false;
+    }
+    if (remove(prepend_mnt_path_string(path).c_str()) != 0)
+    {
+        return false;
+    }
+    file_cache_map::get_instance()->remove_entry(path);
+    return true;
+}
+
 int azs_unlink(const char *path)
 {
     if (AZS_PRINT)
@@ -477,6 +727,9 @@ int azs_unlink(const char *path)
     auto fmutex = file_lock_map::get_instance()->get_mutex(path);
     std::lock_guard<std::mutex> lock(*fmutex);
     int remove_success = remove(mntPath);
+    file_cache_map::get_instance()->remove_entry(pathString);
+    attr_cache::get_instance()->invalidate(pathString);
+    listing_cache::get_instance()->invalidate_parent(pathString);
     // We don't fail if the remove() failed, because that's just removing the file in the local file cache, which may or may not be there.
 
     if (AZS_PRINT)
@@ -533,15 +786,24 @@ int azs_truncate(const char * path, off_t off)
     const char * mntPath;
     std::string mntPathString = prepend_mnt_path_string(pathString);
     mntPath = mntPathString.c_str();
+    attr_cache::get_instance()->invalidate(pathString);
+    listing_cache::get_instance()->invalidate_parent(pathString);
 
     struct stat buf;
     int statret = stat(mntPath, &buf);
     if (statret == 0)
     {
         // The file exists in the local cache.  So, we call truncate() on the file in the cache, then upload a zero-length blob to the service, overriding any data.
-        int truncret = truncate(mntPath, 0);
+        // Any blocks of the file that hadn't yet been fetched are now gone, so the file in the cache is complete.  Fetches that other handles (or their
+        // readahead) have in flight are waited for, so that they can't write their blocks back into the truncated file.
+        auto cache_entry = file_cache_map::get_instance()->get_entry(pathString);
+        int truncret = cache_entry->truncate_file(mntPath);
         if (truncret == 0)
         {
+            cache_entry->note_truncate();
+            cache_entry->mark_modified();
+            unsigned long long generation = cache_entry->get_generation();
+
             // We want to upload a zero-length blob.
             std::istringstream emptyDataStream("");
 
@@ -554,6 +816,7 @@ int azs_truncate(const char * path, off_t off)
             }
             else
             {
+                cache_entry->mark_uploaded(generation);
                 return 0;
             }
 
@@ -574,6 +837,7 @@ int azs_truncate(const char * path, off_t off)
                 return -errno;
             }
             close(fd);
+            file_cache_map::get_instance()->reset_entry(pathString);
 
             // We want to upload a zero-length blob.
             std::istringstream emptyDataStream("");
@@ -642,6 +906,7 @@ int azs_rename_single_file(const char *src, const char *dst)
         {
             return -errno;
         }
+        file_cache_map::get_instance()->rename_entry(srcPathString, dstPathString);
         errno = 0;
         auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, srcPathString.substr(1));
         if ((errno == 0) && blob_property.valid())
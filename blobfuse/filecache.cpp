@@ -0,0 +1,711 @@
+#include "blobfuse.h"
+#include <atomic>
+#include <future>
+#include <algorithm>
+
+// A file_cache_entry is shared by every handle open to the same version of a file in the cache.
+// Block states are protected by m_mutex.  The mutex is never held while communicating with Azure Storage; instead, a block being
+// fetched is marked as such, and other threads that need the same block wait on m_cv until the fetch completes.
+
+unsigned long long file_cache_entry::allocate_id()
+{
+    static std::atomic<unsigned long long> next_id(0);
+    return ++next_id;
+}
+
+std::string file_cache_entry::get_blob()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_blob;
+}
+
+void file_cache_entry::set_blob(const std::string blob)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_blob = blob;
+}
+
+void file_cache_entry::init_partial(unsigned long long size, time_t mtime, unsigned long long block_size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_size = size;
+    m_mtime = mtime;
+    m_block_size = block_size;
+    size_t block_count = (size + block_size - 1) / block_size;
+    m_block_states.assign(block_count, block_missing);
+    m_missing_blocks = block_count;
+}
+
+void file_cache_entry::set_mtime(time_t mtime)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mtime = mtime;
+}
+
+void file_cache_entry::mark_complete()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_block_states.clear();
+    m_block_states.shrink_to_fit();
+    m_missing_blocks = 0;
+    m_stale = false;
+    m_cv.notify_all();
+}
+
+bool file_cache_entry::is_complete()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_block_states.empty();
+}
+
+bool file_cache_entry::is_stale()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stale;
+}
+
+int file_cache_entry::truncate_file(const char *path)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Once the file is complete no new fetches start, so only those already in flight have to be waited for.  The lock is held through the
+    // truncation, so nothing can be fetched between the wait and the truncate.
+    m_block_states.clear();
+    m_block_states.shrink_to_fit();
+    m_missing_blocks = 0;
+    m_stale = false;
+    m_fetch_epoch++;
+    m_cv.notify_all();
+    m_cv.wait(lock, [this]() { return m_fetches == 0; });
+    return truncate(path, 0);
+}
+
+unsigned long long file_cache_entry::get_size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size;
+}
+
+unsigned long long file_cache_entry::get_block_size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_block_size;
+}
+
+unsigned long long file_cache_entry::add_writer()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_writers++;
+    return ++m_writer_epoch;
+}
+
+void file_cache_entry::remove_writer()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_writers--;
+}
+
+void file_cache_entry::note_truncate()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_writer_epoch++;
+}
+
+bool file_cache_entry::is_sole_writer(unsigned long long epoch)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_writers == 1) && (m_writer_epoch == epoch);
+}
+
+// Beyond this many separate modified ranges, the whole file is treated as modified.
+const size_t max_modified_ranges = 4096;
+
+void file_cache_entry::mark_modified()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    m_all_modified = true;
+    m_modified_ranges.clear();
+}
+
+void file_cache_entry::mark_modified(off_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    if (m_all_modified || (size == 0))
+    {
+        return;
+    }
+
+    // Merge the new range with any ranges it overlaps or touches.
+    unsigned long long start = offset;
+    unsigned long long end = start + size;
+    auto iter = m_modified_ranges.upper_bound(start);
+    if (iter != m_modified_ranges.begin())
+    {
+        auto prev = std::prev(iter);
+        if (prev->second >= start)
+        {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            m_modified_ranges.erase(prev);
+        }
+    }
+    while ((iter != m_modified_ranges.end()) && (iter->first <= end))
+    {
+        end = std::max(end, iter->second);
+        iter = m_modified_ranges.erase(iter);
+    }
+    m_modified_ranges[start] = end;
+
+    if (m_modified_ranges.size() > max_modified_ranges)
+    {
+        m_all_modified = true;
+        m_modified_ranges.clear();
+    }
+}
+
+unsigned long long file_cache_entry::get_generation()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
+
+bool file_cache_entry::is_modified()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation != m_uploaded_generation;
+}
+
+void file_cache_entry::mark_uploaded(unsigned long long generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uploaded_generation = std::max(m_uploaded_generation, generation);
+
+    // If the file was modified during the upload, we can't tell which ranges were uploaded, so they're all kept.
+    if (m_uploaded_generation == m_generation)
+    {
+        m_all_modified = false;
+        m_modified_ranges.clear();
+    }
+}
+
+bool file_cache_entry::get_modified_ranges(std::map<unsigned long long, unsigned long long> &ranges)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_all_modified)
+    {
+        return false;
+    }
+    ranges = m_modified_ranges;
+    return true;
+}
+
+std::string file_cache_entry::get_etag()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_etag;
+}
+
+void file_cache_entry::set_etag(const std::string etag)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_etag = etag;
+}
+
+void file_cache_entry::add_handle()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_open_handles++;
+    touch();
+}
+
+void file_cache_entry::remove_handle()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_open_handles--;
+    touch();
+}
+
+void file_cache_entry::touch()
+{
+    m_last_access.store(time(NULL), std::memory_order_relaxed);
+}
+
+time_t file_cache_entry::get_last_access()
+{
+    return m_last_access.load(std::memory_order_relaxed);
+}
+
+bool file_cache_entry::is_evictable()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_open_handles == 0) && (m_generation == m_uploaded_generation);
+}
+
+int file_cache_entry::ensure_range(int fd, off_t offset, size_t size)
+{
+    unsigned long long file_size;
+    unsigned long long block_size;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_block_states.empty())
+        {
+            return 0;
+        }
+        file_size = m_size;
+        block_size = m_block_size;
+    }
+
+    if ((size == 0) || ((unsigned long long)offset >= file_size))
+    {
+        return 0;
+    }
+    unsigned long long end = std::min(file_size, (unsigned long long)offset + size);
+    return ensure_blocks(fd, offset / block_size, (end - 1) / block_size);
+}
+
+int file_cache_entry::fetch_all(int fd, int parallelism)
+{
+    size_t block_count;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_block_states.empty())
+        {
+            return 0;
+        }
+        block_count = m_block_states.size();
+    }
+
+    // Each worker repeatedly claims the next block and fetches it (or waits for it, if some other thread is already fetching it.)
+    // Blocks are written to the cache file at their own offsets, so they can complete in any order.
+    std::atomic<size_t> next_block(0);
+    std::atomic<int> result(0);
+    auto worker = [this, fd, block_count, &next_block, &result]()
+    {
+        size_t index;
+        while ((result.load() == 0) && ((index = next_block++) < block_count))
+        {
+            int ret = ensure_blocks(fd, index, index);
+            if (ret != 0)
+            {
+                int expected = 0;
+                result.compare_exchange_strong(expected, ret);
+            }
+        }
+    };
+
+    size_t worker_count = std::min(block_count, (size_t)std::max(parallelism, 1));
+    std::vector<std::future<void>> workers;
+    for (size_t i = 1; i < worker_count; i++)
+    {
+        workers.push_back(std::async(std::launch::async, worker));
+    }
+    worker();
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].wait();
+    }
+
+    if (result.load() == 0)
+    {
+        mark_complete();
+    }
+    return result.load();
+}
+
+int file_cache_entry::ensure_blocks(int fd, size_t first, size_t last)
+{
+    for (size_t index = first; index <= last; index++)
+    {
+        std::string blob;
+        std::string etag;
+        unsigned long long epoch;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this, index]() { return m_block_states.empty() || m_block_states[index] != block_fetching; });
+            if (m_block_states.empty())
+            {
+                // The file was completed while we were waiting.
+                return 0;
+            }
+            if (m_block_states[index] == block_present)
+            {
+                continue;
+            }
+            if (m_stale)
+            {
+                return -ESTALE;
+            }
+            m_block_states[index] = block_fetching;
+            m_fetches++;
+            epoch = m_fetch_epoch;
+            blob = m_blob;
+            etag = m_etag;
+        }
+
+        int ret = fetch_block(fd, blob, etag, index);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fetches--;
+            if (epoch != m_fetch_epoch)
+            {
+                // The file was truncated while the block was being fetched, so the block is no longer part of it.
+                m_cv.notify_all();
+                return 0;
+            }
+            if (!m_block_states.empty())
+            {
+                if (ret == 0)
+                {
+                    m_block_states[index] = block_present;
+                    m_missing_blocks--;
+                    if (m_missing_blocks == 0)
+                    {
+                        m_block_states.clear();
+                        m_block_states.shrink_to_fit();
+                    }
+                }
+                else
+                {
+                    m_block_states[index] = block_missing;
+                    if (ret == -ESTALE)
+                    {
+                        m_stale = true;
+                    }
+                }
+            }
+            m_cv.notify_all();
+        }
+
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int file_cache_entry::fetch_block(int fd, const std::string &blob, const std::string &etag, size_t index)
+{
+    unsigned long long offset = index * m_block_size;
+    unsigned long long length = std::min(m_block_size, m_size - offset);
+
+    if (AZS_PRINT)
+    {
+        fprintf(stdout, "Fetching block %lu of blob %s, offset = %llu, length = %llu\n", index, blob.c_str(), offset, length);
+    }
+
+    // The range is written straight into the cached file, without being buffered in memory first.  It's only fetched if the blob hasn't changed
+    // since the file was opened; otherwise the file would mix blocks of the old and new versions of the blob.
+    errno = 0;
+    unsigned long long received = azure_blob_client_wrapper->download_blob_to_fd(str_options.containerName, blob, offset, length, fd, offset, etag);
+    if (errno == 412)
+    {
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "Blob %s changed on the service while it was being fetched.\n", blob.c_str());
+        }
+        return -ESTALE;
+    }
+    if (errno != 0)
+    {
+        return 0 - map_errno(errno);
+    }
+    if (received != length)
+    {
+        // The blob has changed size on the service since the file was opened (or the write to the cache failed.)
+        return -EIO;
+    }
+
+    // Writing the block updates the file's modified time; restore it, so that the cache timeout is still measured from when the file was opened.
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        times[1].tv_sec = m_mtime;
+    }
+    times[1].tv_nsec = 0;
+    futimens(fd, times);
+    return 0;
+}
+
+readahead_state::readahead_state(std::shared_ptr<file_cache_entry> cache_entry, int fd)
+    : m_cache_entry(cache_entry), m_fd(fd), m_next_offset(0), m_last_block(0), m_window(0), m_next_block(0), m_end_block(0), m_generation(0), m_active_workers(0)
+{
+}
+
+readahead_state::~readahead_state()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_generation++;
+        m_end_block = 0;
+    }
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].wait();
+    }
+}
+
+void readahead_state::on_read(off_t offset, size_t size)
+{
+    if ((max_readahead_blocks <= 0) || (size == 0) || m_cache_entry->is_complete())
+    {
+        return;
+    }
+    unsigned long long file_size = m_cache_entry->get_size();
+    unsigned long long block_size = m_cache_entry->get_block_size();
+    if ((unsigned long long)offset >= file_size)
+    {
+        return;
+    }
+    unsigned long long end = std::min(file_size, (unsigned long long)offset + size);
+    size_t last_block = (end - 1) / block_size;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // With multiple FUSE threads, the kernel's own readahead requests can arrive slightly out of order, so anything that starts
+    // within a block of where the previous read ended still counts as sequential.
+    long long distance = (long long)offset - (long long)m_next_offset;
+    bool sequential = (distance <= (long long)block_size) && (distance >= 0 - (long long)block_size);
+    m_next_offset = end;
+    if (!sequential)
+    {
+        if (AZS_PRINT && (m_window != 0))
+        {
+            fprintf(stdout, "Cancelling readahead of blob %s, read at offset %lld is not sequential\n", m_cache_entry->get_blob().c_str(), (long long)offset);
+        }
+        m_generation++;
+        m_active_workers = 0;
+        m_window = 0;
+        m_next_block = 0;
+        m_end_block = 0;
+        m_last_block = last_block;
+        return;
+    }
+
+    if (m_window == 0)
+    {
+        m_window = 1;
+    }
+    else if (last_block != m_last_block)
+    {
+        m_window = std::min(m_window * 2, (size_t)max_readahead_blocks);
+    }
+    m_last_block = last_block;
+
+    // The blocks covered by this read are fetched by the reader itself; readahead starts from the block after.
+    size_t block_count = (file_size + block_size - 1) / block_size;
+    m_next_block = std::max(m_next_block, last_block + 1);
+    m_end_block = std::max(m_end_block, std::min(block_count, last_block + 1 + m_window));
+
+    for (size_t i = 0; i < m_workers.size();)
+    {
+        if (m_workers[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            m_workers.erase(m_workers.begin() + i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    size_t pending = (m_end_block > m_next_block) ? (m_end_block - m_next_block) : 0;
+    size_t wanted = std::min(pending, (size_t)std::max(download_parallelism, 1));
+    while ((size_t)m_active_workers < wanted)
+    {
+        m_active_workers++;
+        m_workers.push_back(std::async(std::launch::async, &readahead_state::worker, this, m_generation));
+    }
+}
+
+void readahead_state::worker(unsigned int generation)
+{
+    unsigned long long block_size = m_cache_entry->get_block_size();
+    while (true)
+    {
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if ((generation != m_generation) || (m_next_block >= m_end_block))
+            {
+                if (generation == m_generation)
+                {
+                    m_active_workers--;
+                }
+                return;
+            }
+            index = m_next_block++;
+        }
+
+        // Failures are not reported here; the block stays missing, and the reader will fetch it (and see the error) itself.
+        if (m_cache_entry->ensure_range(m_fd, index * block_size, block_size) != 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (generation == m_generation)
+            {
+                m_active_workers--;
+            }
+            return;
+        }
+    }
+}
+
+std::shared_ptr<file_cache_map> file_cache_map::_instance;
+std::mutex file_cache_map::s_mutex;
+
+file_cache_map* file_cache_map::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new file_cache_map());
+        }
+    }
+    return _instance.get();
+}
+
+std::shared_ptr<file_cache_entry> file_cache_map::get_entry(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_entries.find(path);
+    if(iter == m_entries.end())
+    {
+        auto entry = std::make_shared<file_cache_entry>(path.substr(1));
+        m_entries[path] = entry;
+        return entry;
+    }
+    else
+    {
+        return iter->second;
+    }
+}
+
+std::shared_ptr<file_cache_entry> file_cache_map::reset_entry(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto entry = std::make_shared<file_cache_entry>(path.substr(1));
+    auto iter = m_entries.find(path);
+    if (iter != m_entries.end())
+    {
+        // The blocks of the prior version of the file are never looked up again; free them now rather than waiting for them to be evicted.
+        block_cache::get_instance()->remove_file(iter->second->get_id());
+    }
+    m_entries[path] = entry;
+    return entry;
+}
+
+void file_cache_map::remove_entry(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_entries.find(path);
+    if (iter != m_entries.end())
+    {
+        block_cache::get_instance()->remove_file(iter->second->get_id());
+        m_entries.erase(iter);
+    }
+}
+
+void file_cache_map::rename_entry(const std::string &src, const std::string &dst)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_entries.find(src);
+    if (iter == m_entries.end())
+    {
+        m_entries.erase(dst);
+        return;
+    }
+    auto entry = iter->second;
+    m_entries.erase(iter);
+    entry->set_blob(dst.substr(1));
+    m_entries[dst] = entry;
+}
+
+void file_cache_map::start_eviction(unsigned long long high_watermark, unsigned long long low_watermark)
+{
+    m_eviction_thread = std::thread(&file_cache_map::run_eviction, this, high_watermark, low_watermark);
+}
+
+void file_cache_map::stop_eviction()
+{
+    if (!m_eviction_thread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_eviction_mutex);
+        m_stop_eviction = true;
+        m_eviction_cv.notify_all();
+    }
+    m_eviction_thread.join();
+}
+
+void file_cache_map::run_eviction(unsigned long long high_watermark, unsigned long long low_watermark)
+{
+    struct cached_file
+    {
+        std::string path;
+        time_t last_access;
+        unsigned long long size;
+    };
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_eviction_mutex);
+            m_eviction_cv.wait_for(lock, std::chrono::seconds(1), [this]() { return m_stop_eviction; });
+            if (m_stop_eviction)
+            {
+                return;
+            }
+        }
+
+        std::vector<std::pair<std::string, std::shared_ptr<file_cache_entry>>> entries;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            entries.assign(m_entries.begin(), m_entries.end());
+        }
+
+        // Files in the cache can be sparse (partial), so count the space that is actually allocated to them.
+        unsigned long long total_size = 0;
+        std::vector<cached_file> candidates;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            struct stat buf;
+            if (stat(prepend_mnt_path_string(entries[i].first).c_str(), &buf) != 0)
+            {
+                continue;
+            }
+            unsigned long long size = (unsigned long long)buf.st_blocks * 512;
+            total_size += size;
+            if (entries[i].second->is_evictable())
+            {
+                cached_file file = {entries[i].first, entries[i].second->get_last_access(), size};
+                candidates.push_back(file);
+            }
+        }
+        if (total_size <= high_watermark)
+        {
+            continue;
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const cached_file &a, const cached_file &b) { return a.last_access < b.last_access; });
+        for (size_t i = 0; (i < candidates.size()) && (total_size > low_watermark); i++)
+        {
+            if (evict_from_cache(candidates[i].path))
+            {
+                if (AZS_PRINT)
+                {
+                    fprintf(stdout, "Evicted %s from the cache, %llu bytes\n", candidates[i].path.c_str(), candidates[i].size);
+                }
+                total_size -= candidates[i].size;
+            }
+        }
+    }
+}
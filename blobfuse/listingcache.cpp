@@ -0,0 +1,125 @@
+#include "blobfuse.h"
+
+std::shared_ptr<listing_cache> listing_cache::_instance;
+std::mutex listing_cache::s_mutex;
+
+listing_cache* listing_cache::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new listing_cache());
+        }
+    }
+    return _instance.get();
+}
+
+unsigned long long listing_cache::get_generation()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
+
+void listing_cache::put(const std::string &path, std::shared_ptr<const std::vector<dir_entry>> listing, unsigned long long generation)
+{
+    if ((list_cache_timeout_in_seconds <= 0) || (listing->size() > max_cached_listing_size))
+    {
+        return;
+    }
+
+    time_t now = time(NULL);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (generation != m_generation)
+    {
+        return;
+    }
+    auto iter = m_listings.find(path);
+    if (iter != m_listings.end())
+    {
+        erase(iter);
+    }
+
+    m_order.push_back(path);
+    cached_listing &cached = m_listings[path];
+    cached.listing = listing;
+    cached.expiry = now + list_cache_timeout_in_seconds;
+    cached.order_position = std::prev(m_order.end());
+    m_size += listing->size();
+
+    // Since every listing has the same timeout, the oldest listing is also the first to expire.
+    while (!m_order.empty())
+    {
+        auto oldest = m_listings.find(m_order.front());
+        if ((m_size <= max_listing_cache_entries) && (oldest->second.expiry >= now))
+        {
+            break;
+        }
+        erase(oldest);
+    }
+}
+
+std::shared_ptr<const std::vector<dir_entry>> listing_cache::get(const std::string &path)
+{
+    if (list_cache_timeout_in_seconds <= 0)
+    {
+        return std::shared_ptr<const std::vector<dir_entry>>();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_listings.find(path);
+    if (iter == m_listings.end())
+    {
+        return std::shared_ptr<const std::vector<dir_entry>>();
+    }
+    if (iter->second.expiry < time(NULL))
+    {
+        erase(iter);
+        return std::shared_ptr<const std::vector<dir_entry>>();
+    }
+    return iter->second.listing;
+}
+
+void listing_cache::invalidate_parent(const std::string &path)
+{
+    size_t last_slash_idx = path.rfind('/');
+    if (std::string::npos == last_slash_idx)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto iter = m_listings.find(path.substr(0, last_slash_idx + 1));
+    if (iter != m_listings.end())
+    {
+        erase(iter);
+    }
+}
+
+void listing_cache::invalidate_tree(const std::string &path)
+{
+    std::string prefix = path;
+    if (prefix.empty() || (prefix.back() != '/'))
+    {
+        prefix.push_back('/');
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto iter = m_listings.lower_bound(prefix);
+    while ((iter != m_listings.end()) && (iter->first.compare(0, prefix.size(), prefix) == 0))
+    {
+        auto next = std::next(iter);
+        erase(iter);
+        iter = next;
+    }
+}
+
+void listing_cache::erase(std::map<std::string, cached_listing>::iterator iter)
+{
+    m_size -= iter->second.listing->size();
+    m_order.erase(iter->second.order_position);
+    m_listings.erase(iter);
+}
@@ -0,0 +1,803 @@
+#include "blobfuse.h"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// The parent ID of the nodes for the top level of the container.
+const uint32_t root_id = 0xFFFFFFFF;
+
+// The child_count of a node that isn't in use.
+const uint32_t free_node = 0xFFFFFFFF;
+
+namespace {
+
+    // FNV-1a of the parent ID and the name.  Like a node ID, the low bits pick the shard, and the rest the slot in the shard's hash table.
+    uint32_t hash_name(uint32_t parent, const char *name, size_t length)
+    {
+        uint32_t hash = 2166136261u;
+        for (int i = 0; i < 4; i++)
+        {
+            hash = (hash ^ ((parent >> (i * 8)) & 0xFF)) * 16777619u;
+        }
+        for (size_t i = 0; i < length; i++)
+        {
+            hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Listings return ETags without the quotes that Get Blob Properties returns them with.
+    uint32_t hash_etag(const std::string &etag)
+    {
+        if ((etag.size() >= 2) && (etag.front() == '"') && (etag.back() == '"'))
+        {
+            return hash_name(0, etag.data() + 1, etag.size() - 2);
+        }
+        return hash_name(0, etag.data(), etag.size());
+    }
+
+    // Returns the next component of the path at or after position, or false if there are no more.  Empty components are skipped.
+    bool next_component(const std::string &path, size_t &position, size_t &length)
+    {
+        while ((position < path.size()) && (path[position] == '/'))
+        {
+            position++;
+        }
+        if (position >= path.size())
+        {
+            return false;
+        }
+        size_t end = path.find('/', position);
+        length = ((end == std::string::npos) ? path.size() : end) - position;
+        return true;
+    }
+}
+
+uint32_t name_tree::make_id(size_t shard, uint32_t index)
+{
+    return (index << shard_bits) | shard;
+}
+
+size_t name_tree::shard_of(uint32_t id)
+{
+    return id & (shard_count - 1);
+}
+
+uint32_t name_tree::index_of(uint32_t id)
+{
+    return id >> shard_bits;
+}
+
+name_tree::name_tree() : m_epoch(time(NULL)), m_invalidations(0), m_root_invalidated(0), m_removals(0), m_size(0), m_next_prune(1024)
+{
+}
+
+void name_tree::put(const std::string &path, const struct stat &stbuf, const std::string &etag, time_t expiry)
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    uint32_t parent = root_id;
+    size_t position = 0;
+    size_t length = 0;
+    if (!next_component(path, position, length))
+    {
+        return;
+    }
+    while (true)
+    {
+        const char *name = path.data() + position;
+        size_t name_length = length;
+        if (name_length > 0x7FFF)
+        {
+            return;
+        }
+        position += name_length;
+        bool last = !next_component(path, position, length);
+
+        uint32_t hash = hash_name(parent, name, name_length);
+        size_t shard_index = shard_of(hash);
+        shard &s = m_shards[shard_index];
+        uint32_t index;
+        bool created = false;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            size_t slot = find_slot(s, hash, parent, name, name_length);
+            if (s.slots[slot] != 0)
+            {
+                index = s.slots[slot] - 1;
+            }
+            else
+            {
+                index = add(s, slot, parent, name, name_length);
+                if (index == free_node)
+                {
+                    return;
+                }
+                created = true;
+            }
+
+            if (last)
+            {
+                node &n = s.nodes[index];
+                n.size = stbuf.st_size;
+                n.mtime = stbuf.st_mtime;
+                n.mode = (expiry < m_epoch) ? 0 : stbuf.st_mode; // Expired before the tree was created.
+                n.etag_hash = hash_etag(etag);
+                n.stamp = m_invalidations;
+                n.unverified = 0;
+                n.expiry = std::min((long long)0xFFFFFFFF, std::max((long long)0, (long long)(expiry - m_epoch)));
+            }
+        }
+
+        // Only one shard lock is held at a time.  Pruning also holds m_write_mutex, so the parent can't be removed before its count includes the new node.
+        if (created && (parent != root_id))
+        {
+            shard &p = m_shards[shard_of(parent)];
+            std::lock_guard<std::mutex> lock(p.mutex);
+            p.nodes[index_of(parent)].child_count++;
+        }
+        parent = make_id(shard_index, index);
+        if (last)
+        {
+            break;
+        }
+    }
+
+    if (m_size >= m_next_prune)
+    {
+        prune();
+        // Entries that haven't expired stay until the tree has doubled in size, so that a large directory tree doesn't cause a full scan on every insert.
+        m_next_prune = std::max((size_t)1024, m_size * 2);
+    }
+}
+
+bool name_tree::get(const std::string &path, struct stat *stbuf, bool *unverified)
+{
+    node found;
+    uint32_t invalidated;
+    uint32_t removals = m_removals;
+    uint32_t id = ((removals & 1) == 0) ? lookup(path, &found, &invalidated) : root_id;
+    if (((removals & 1) != 0) || (m_removals != removals))
+    {
+        // A node on the path may have been removed, and its index reused by a node with a different path, while the path was being walked.
+        std::lock_guard<std::mutex> write_lock(m_write_mutex);
+        id = lookup(path, &found, &invalidated);
+    }
+    if (id == root_id)
+    {
+        return false;
+    }
+
+    // The attributes are stale if the subtree of the node, or of any node above it, was invalidated after they were set.
+    if ((found.mode == 0) || (found.stamp < invalidated) || ((long long)found.expiry < (long long)(time(NULL) - m_epoch)))
+    {
+        return false;
+    }
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = found.mode;
+    stbuf->st_nlink = S_ISDIR(found.mode) ? 3 : 1;
+    stbuf->st_size = found.size;
+    stbuf->st_mtime = found.mtime;
+    if (unverified != NULL)
+    {
+        *unverified = found.unverified;
+    }
+    return true;
+}
+
+bool name_tree::verify(const std::string &path, const std::string &etag, time_t expiry)
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    node found;
+    uint32_t invalidated;
+    uint32_t id = lookup(path, &found, &invalidated);
+    if ((id == root_id) || (found.mode == 0) || (found.stamp < invalidated) || (found.etag_hash != hash_etag(etag)))
+    {
+        return false;
+    }
+
+    shard &s = m_shards[shard_of(id)];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    node &n = s.nodes[index_of(id)];
+    n.unverified = 0;
+    n.expiry = std::min((long long)0xFFFFFFFF, std::max((long long)0, (long long)(expiry - m_epoch)));
+    return true;
+}
+
+void name_tree::invalidate(const std::string &path)
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    uint32_t id = lookup(path, NULL, NULL);
+    if (id != root_id)
+    {
+        shard &s = m_shards[shard_of(id)];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.nodes[index_of(id)].mode = 0;
+    }
+}
+
+void name_tree::invalidate_tree(const std::string &path)
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    uint32_t invalidation = ++m_invalidations;
+    size_t position = 0;
+    size_t length = 0;
+    if (!next_component(path, position, length))
+    {
+        m_root_invalidated = invalidation;
+        return;
+    }
+    uint32_t id = lookup(path, NULL, NULL);
+    if (id != root_id)
+    {
+        shard &s = m_shards[shard_of(id)];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        node &n = s.nodes[index_of(id)];
+        n.invalidated = invalidation;
+        n.mode = 0;
+    }
+}
+
+uint32_t name_tree::lookup(const std::string &path, node *found, uint32_t *invalidated)
+{
+    uint32_t latest = m_root_invalidated;
+    uint32_t parent = root_id;
+    size_t position = 0;
+    size_t length = 0;
+    while (next_component(path, position, length))
+    {
+        const char *name = path.data() + position;
+        position += length;
+        uint32_t hash = hash_name(parent, name, length);
+        size_t shard_index = shard_of(hash);
+        shard &s = m_shards[shard_index];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        size_t slot = find_slot(s, hash, parent, name, length);
+        if (s.slots[slot] == 0)
+        {
+            return root_id;
+        }
+        const node &n = s.nodes[s.slots[slot] - 1];
+        latest = std::max(latest, n.invalidated);
+        if (found != NULL)
+        {
+            *found = n;
+        }
+        parent = make_id(shard_index, s.slots[slot] - 1);
+    }
+    if (invalidated != NULL)
+    {
+        *invalidated = latest;
+    }
+    return parent;
+}
+
+size_t name_tree::find_slot(shard &s, uint32_t hash, uint32_t parent, const char *name, size_t length)
+{
+    size_t mask = s.slots.size() - 1;
+    for (size_t slot = index_of(hash) & mask; ; slot = (slot + 1) & mask)
+    {
+        if (s.slots[slot] == 0)
+        {
+            return slot;
+        }
+        const node &n = s.nodes[s.slots[slot] - 1];
+        if ((n.parent == parent) && (n.name_length == length) && (memcmp(s.names.data() + n.name, name, length) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+uint32_t name_tree::add(shard &s, size_t slot, uint32_t parent, const char *name, size_t length)
+{
+    if ((s.used >= index_of(root_id)) || (s.names.size() + length > 0xFFFFFFFF))
+    {
+        return free_node;
+    }
+
+    uint32_t index;
+    if (s.free_list != free_node)
+    {
+        index = s.free_list;
+        s.free_list = s.nodes[index].parent;
+    }
+    else
+    {
+        index = s.nodes.size();
+        s.nodes.push_back(node());
+    }
+    node &n = s.nodes[index];
+    memset(&n, 0, sizeof(n));
+    n.parent = parent;
+    n.name = s.names.size();
+    n.name_length = length;
+    s.names.insert(s.names.end(), name, name + length);
+    s.slots[slot] = index + 1;
+    s.used++;
+    m_size++;
+
+    // Keep the hash table at most 70% full.
+    if (s.used * 10 > s.slots.size() * 7)
+    {
+        rehash(s);
+    }
+    return index;
+}
+
+void name_tree::remove(shard &s, uint32_t index)
+{
+    node &n = s.nodes[index];
+    uint32_t hash = hash_name(n.parent, s.names.data() + n.name, n.name_length);
+    size_t mask = s.slots.size() - 1;
+    size_t slot = index_of(hash) & mask;
+    while (s.slots[slot] != index + 1)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    // Shift back any entries after it that wouldn't be found with the slot emptied, so that the table needs no tombstones.
+    size_t next = slot;
+    while (true)
+    {
+        next = (next + 1) & mask;
+        if (s.slots[next] == 0)
+        {
+            break;
+        }
+        const node &other = s.nodes[s.slots[next] - 1];
+        size_t home = index_of(hash_name(other.parent, s.names.data() + other.name, other.name_length)) & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            s.slots[slot] = s.slots[next];
+            slot = next;
+        }
+    }
+    s.slots[slot] = 0;
+
+    s.garbage += n.name_length;
+    n.child_count = free_node;
+    n.parent = s.free_list;
+    s.free_list = index;
+    s.used--;
+    m_size--;
+    if ((s.garbage > 65536) && (s.garbage * 2 > s.names.size()))
+    {
+        compact_names(s);
+    }
+}
+
+void name_tree::rehash(shard &s)
+{
+    std::vector<uint32_t> slots(s.slots.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < s.nodes.size(); i++)
+    {
+        const node &n = s.nodes[i];
+        if (n.child_count == free_node)
+        {
+            continue;
+        }
+        size_t slot = index_of(hash_name(n.parent, s.names.data() + n.name, n.name_length)) & mask;
+        while (slots[slot] != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = i + 1;
+    }
+    s.slots.swap(slots);
+}
+
+void name_tree::compact_names(shard &s)
+{
+    std::vector<char> names;
+    names.reserve(s.names.size() - s.garbage);
+    for (size_t i = 0; i < s.nodes.size(); i++)
+    {
+        node &n = s.nodes[i];
+        if (n.child_count == free_node)
+        {
+            continue;
+        }
+        uint32_t offset = names.size();
+        names.insert(names.end(), s.names.begin() + n.name, s.names.begin() + n.name + n.name_length);
+        n.name = offset;
+    }
+    s.names.swap(names);
+    s.garbage = 0;
+}
+
+void name_tree::prune()
+{
+    long long now = time(NULL) - m_epoch;
+    std::vector<uint32_t> released; // Parents of removed nodes.
+    m_removals++;
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        shard &s = m_shards[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (size_t index = 0; index < s.nodes.size(); index++)
+        {
+            node &n = s.nodes[index];
+            if (n.child_count == free_node)
+            {
+                continue;
+            }
+            if ((long long)n.expiry < now)
+            {
+                n.mode = 0;
+            }
+            if ((n.mode == 0) && (n.child_count == 0))
+            {
+                if (n.parent != root_id)
+                {
+                    released.push_back(n.parent);
+                }
+                remove(s, index);
+            }
+        }
+    }
+
+    // Nodes that were only on the way to removed nodes are removed too.
+    while (!released.empty())
+    {
+        uint32_t id = released.back();
+        released.pop_back();
+        shard &s = m_shards[shard_of(id)];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        node &n = s.nodes[index_of(id)];
+        n.child_count--;
+        if ((n.child_count == 0) && ((n.mode == 0) || ((long long)n.expiry < now)))
+        {
+            if (n.parent != root_id)
+            {
+                released.push_back(n.parent);
+            }
+            remove(s, index_of(id));
+        }
+    }
+    m_removals++;
+}
+
+// The snapshot is the header, the identity, and then for each shard its snapshot_shard followed by its nodes, hash table and arena, as they are in memory.
+// It's only read by the same build on the same machine, so there is no need for a portable format.
+namespace {
+
+    const char snapshot_magic[8] = {'B', 'F', 'N', 'T', 'R', 'E', 'E', '1'};
+
+    struct snapshot_header
+    {
+        char magic[8];
+        uint32_t node_size;
+        uint32_t shard_count;
+        uint32_t identity_length;
+        uint32_t invalidations;
+        uint32_t root_invalidated;
+    };
+
+    struct snapshot_shard
+    {
+        unsigned long long node_count;
+        unsigned long long used;
+        unsigned long long garbage;
+        unsigned long long slot_count;
+        unsigned long long names_size;
+        uint32_t free_list;
+    };
+
+    bool write_all(FILE *out, const void *data, size_t size)
+    {
+        return (size == 0) || (fwrite(data, 1, size, out) == size);
+    }
+}
+
+bool name_tree::save(const std::string &file, const std::string &identity)
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+
+    // Write to another file and rename it over the old snapshot, so that a crash while saving leaves the old one intact.
+    std::string temp = file + ".tmp";
+    FILE *out = fopen(temp.c_str(), "wb");
+    if (out == NULL)
+    {
+        return false;
+    }
+
+    snapshot_header header;
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.node_size = sizeof(node);
+    header.shard_count = shard_count;
+    header.identity_length = identity.size();
+    header.invalidations = m_invalidations;
+    header.root_invalidated = m_root_invalidated;
+    bool success = write_all(out, &header, sizeof(header)) && write_all(out, identity.data(), identity.size());
+    for (size_t i = 0; success && (i < shard_count); i++)
+    {
+        shard &s = m_shards[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        snapshot_shard shard_header;
+        shard_header.node_count = s.nodes.size();
+        shard_header.used = s.used;
+        shard_header.garbage = s.garbage;
+        shard_header.slot_count = s.slots.size();
+        shard_header.names_size = s.names.size();
+        shard_header.free_list = s.free_list;
+        success = write_all(out, &shard_header, sizeof(shard_header)) &&
+            write_all(out, s.nodes.data(), s.nodes.size() * sizeof(node)) &&
+            write_all(out, s.slots.data(), s.slots.size() * sizeof(uint32_t)) &&
+            write_all(out, s.names.data(), s.names.size());
+    }
+    success = (fclose(out) == 0) && success;
+    if (!success || (rename(temp.c_str(), file.c_str()) != 0))
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool name_tree::load(const std::string &file, const std::string &identity)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat stbuf;
+    if ((fstat(fd, &stbuf) != 0) || (stbuf.st_size < (off_t)sizeof(snapshot_header)))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = stbuf.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+
+    const char *data = (const char *)mapping;
+    size_t position = 0;
+    auto take = [&](size_t length) -> const char *
+    {
+        if (length > size - position)
+        {
+            return NULL;
+        }
+        const char *result = data + position;
+        position += length;
+        return result;
+    };
+
+    // Read into separate shards, so that nothing in the tree is replaced until the whole snapshot has been checked.
+    std::unique_ptr<shard[]> loaded(new shard[shard_count]);
+    snapshot_header header;
+    const char *header_data = take(sizeof(header));
+    if (header_data == NULL)
+    {
+        munmap(mapping, size);
+        return false;
+    }
+    memcpy(&header, header_data, sizeof(header));
+    const char *saved_identity = take(header.identity_length);
+    bool success = (memcmp(header.magic, snapshot_magic, sizeof(header.magic)) == 0) && (header.node_size == sizeof(node)) &&
+        (header.shard_count == shard_count) && (saved_identity != NULL) && (identity.compare(0, std::string::npos, saved_identity, header.identity_length) == 0);
+    size_t total = 0;
+    for (size_t i = 0; success && (i < shard_count); i++)
+    {
+        shard &s = loaded[i];
+        const char *shard_data = take(sizeof(snapshot_shard));
+        if (shard_data == NULL)
+        {
+            success = false;
+            break;
+        }
+        snapshot_shard shard_header;
+        memcpy(&shard_header, shard_data, sizeof(shard_header));
+        const char *nodes = ((shard_header.node_count <= size) ? take(shard_header.node_count * sizeof(node)) : NULL);
+        const char *slots = ((shard_header.slot_count <= size) ? take(shard_header.slot_count * sizeof(uint32_t)) : NULL);
+        const char *names = take(shard_header.names_size);
+        if ((nodes == NULL) || (slots == NULL) || (names == NULL) || (shard_header.slot_count == 0) || ((shard_header.slot_count & (shard_header.slot_count - 1)) != 0))
+        {
+            success = false;
+            break;
+        }
+        s.nodes.resize(shard_header.node_count);
+        memcpy(s.nodes.data(), nodes, shard_header.node_count * sizeof(node));
+        s.slots.assign((const uint32_t *)slots, (const uint32_t *)slots + shard_header.slot_count);
+        s.names.assign(names, names + shard_header.names_size);
+        s.used = shard_header.used;
+        s.garbage = shard_header.garbage;
+        s.free_list = shard_header.free_list;
+        total += s.used;
+    }
+    munmap(mapping, size);
+
+    if (!success || !check_shards(loaded.get()))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        shard &s = m_shards[i];
+        shard &from = loaded[i];
+
+        // Expiry times are relative to the epoch of the tree that saved them; the attributes last until they're verified instead.
+        for (size_t index = 0; index < from.nodes.size(); index++)
+        {
+            node &n = from.nodes[index];
+            if ((n.child_count != free_node) && (n.mode != 0))
+            {
+                n.unverified = 1;
+                n.expiry = 0xFFFFFFFF;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.nodes.swap(from.nodes);
+        s.slots.swap(from.slots);
+        s.names.swap(from.names);
+        s.used = from.used;
+        s.garbage = from.garbage;
+        s.free_list = from.free_list;
+    }
+    m_invalidations = header.invalidations;
+    m_root_invalidated = header.root_invalidated;
+    m_size = total;
+    m_next_prune = std::max((size_t)1024, m_size * 2);
+    return true;
+}
+
+bool name_tree::check_shards(shard *shards)
+{
+    // Every index is checked before it's used, so that a corrupt snapshot is rejected instead of being read out of bounds.
+    std::vector<uint32_t> child_counts[shard_count];
+    size_t total = 0;
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        shard &s = shards[i];
+        size_t node_count = s.nodes.size();
+        if ((node_count > index_of(root_id)) || (s.used > node_count) || (s.garbage > s.names.size()) || (s.names.size() > 0xFFFFFFFF) ||
+            (s.slots.size() < 1024) || (s.used * 10 > s.slots.size() * 7))
+        {
+            return false;
+        }
+
+        size_t used = 0;
+        for (const node &n : s.nodes)
+        {
+            if (n.child_count == free_node)
+            {
+                continue;
+            }
+            used++;
+            if (((size_t)n.name + n.name_length > s.names.size()) ||
+                ((n.parent != root_id) && (index_of(n.parent) >= shards[shard_of(n.parent)].nodes.size())))
+            {
+                return false;
+            }
+        }
+        if (used != s.used)
+        {
+            return false;
+        }
+        total += used;
+
+        // The free list has to be made of exactly the free nodes, without a loop.
+        size_t free_count = 0;
+        for (uint32_t index = s.free_list; index != free_node; index = s.nodes[index].parent)
+        {
+            if ((index >= node_count) || (s.nodes[index].child_count != free_node) || (++free_count > node_count - used))
+            {
+                return false;
+            }
+        }
+        if (free_count != node_count - used)
+        {
+            return false;
+        }
+
+        size_t filled = 0;
+        for (uint32_t value : s.slots)
+        {
+            if (value == 0)
+            {
+                continue;
+            }
+            filled++;
+            if ((value > node_count) || (s.nodes[value - 1].child_count == free_node))
+            {
+                return false;
+            }
+        }
+
+        // There are as many filled slots as nodes in use, so if each node can be found, each is in exactly one slot.
+        if (filled != used)
+        {
+            return false;
+        }
+        for (size_t index = 0; index < node_count; index++)
+        {
+            const node &n = s.nodes[index];
+            if (n.child_count == free_node)
+            {
+                continue;
+            }
+            const char *name = s.names.data() + n.name;
+            uint32_t hash = hash_name(n.parent, name, n.name_length);
+            if ((shard_of(hash) != i) || (s.slots[find_slot(s, hash, n.parent, name, n.name_length)] != index + 1))
+            {
+                return false;
+            }
+        }
+        child_counts[i].assign(node_count, 0);
+    }
+
+    // Parents have to be nodes in use, with a child_count of their children, and following them has to reach the top level.
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        for (const node &n : shards[i].nodes)
+        {
+            if ((n.child_count == free_node) || (n.parent == root_id))
+            {
+                continue;
+            }
+            if (shards[shard_of(n.parent)].nodes[index_of(n.parent)].child_count == free_node)
+            {
+                return false;
+            }
+            child_counts[shard_of(n.parent)][index_of(n.parent)]++;
+        }
+    }
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        for (size_t index = 0; index < shards[i].nodes.size(); index++)
+        {
+            const node &n = shards[i].nodes[index];
+            if ((n.child_count != free_node) && (n.child_count != child_counts[i][index]))
+            {
+                return false;
+            }
+        }
+    }
+
+    // A node is reached from the top level only if its parent is; nodes on a loop of parents never are.
+    std::vector<char> reached[shard_count];
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        reached[i].assign(shards[i].nodes.size(), 0);
+    }
+    std::vector<uint32_t> path;
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        for (size_t index = 0; index < shards[i].nodes.size(); index++)
+        {
+            if ((shards[i].nodes[index].child_count == free_node) || reached[i][index])
+            {
+                continue;
+            }
+
+            // Walk up until a node already known to be reached, or the top level.  A walk longer than the number of nodes in use has gone round a loop.
+            path.clear();
+            uint32_t id = make_id(i, index);
+            while ((id != root_id) && !reached[shard_of(id)][index_of(id)])
+            {
+                path.push_back(id);
+                if (path.size() > total)
+                {
+                    return false;
+                }
+                id = shards[shard_of(id)].nodes[index_of(id)].parent;
+            }
+            for (uint32_t on_path : path)
+            {
+                reached[shard_of(on_path)][index_of(on_path)] = 1;
+            }
+        }
+    }
+    return true;
+}
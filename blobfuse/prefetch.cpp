@@ -0,0 +1,106 @@
+#include "blobfuse.h"
+
+std::shared_ptr<listing_prefetcher> listing_prefetcher::_instance;
+std::mutex listing_prefetcher::s_mutex;
+
+listing_prefetcher* listing_prefetcher::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new listing_prefetcher());
+        }
+    }
+    return _instance.get();
+}
+
+void listing_prefetcher::start(int thread_count)
+{
+    for (int i = 0; i < thread_count; i++)
+    {
+        m_threads.push_back(std::thread(&listing_prefetcher::run, this));
+    }
+}
+
+void listing_prefetcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_cv.notify_all();
+    }
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i].join();
+    }
+    m_threads.clear();
+}
+
+void listing_prefetcher::enqueue(const std::vector<std::string> &paths)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_threads.empty() || m_stop)
+    {
+        return;
+    }
+
+    auto position = m_queue.begin();
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (m_queued.insert(paths[i]).second)
+        {
+            m_queue.insert(position, paths[i]);
+        }
+    }
+    while (m_queue.size() > max_prefetch_queue_size)
+    {
+        m_queued.erase(m_queue.back());
+        m_queue.pop_back();
+    }
+    m_cv.notify_all();
+}
+
+void listing_prefetcher::run()
+{
+    while (true)
+    {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+            if (m_stop)
+            {
+                return;
+            }
+            path = m_queue.front();
+            m_queue.pop_front();
+            m_queued.erase(path);
+        }
+
+        if (!listing_cache::get_instance()->get(path))
+        {
+            if (AZS_PRINT)
+            {
+                fprintf(stdout, "Prefetching the listing of %s\n", path.c_str());
+            }
+
+            // List the directory the same way azs_readdir() does, which fills the attribute cache as it goes, and cache the listing.
+            dirhandle dh(path);
+            dh.listing = std::make_shared<std::vector<dir_entry>>();
+            dh.listing_generation = listing_cache::get_instance()->get_generation();
+            while (dh.listing && (!dh.listing_started || !dh.continuation.empty()))
+            {
+                if (fetch_next_page(&dh) != 0)
+                {
+                    break;
+                }
+            }
+            if (dh.listing && dh.listing_started && dh.continuation.empty())
+            {
+                listing_cache::get_instance()->put(path, dh.listing, dh.listing_generation);
+            }
+        }
+    }
+}
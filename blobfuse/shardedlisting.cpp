@@ -0,0 +1,254 @@
+#include "blobfuse.h"
+
+sharded_listing::sharded_listing(const std::string &container, const std::string &prefix, const std::string &start_after, const std::string &continuation, int parallelism)
+    : m_container(container), m_max_buffered_pages(2 * parallelism), m_buffered_pages(0), m_error(0), m_stop(false)
+{
+    // The listing carries on sequentially from where it got to, until its names show where it's worth splitting.
+    range whole;
+    whole.prefix = prefix;
+    whole.start_after = start_after;
+    whole.depth = 0;
+    whole.probe = false;
+    whole.fetching = false;
+    whole.finished = false;
+    whole.continuation = continuation;
+    m_ranges.push_back(whole);
+    m_current = m_ranges.begin();
+    for (int i = 0; i < parallelism; i++)
+    {
+        m_workers.push_back(std::thread(&sharded_listing::run, this));
+    }
+}
+
+sharded_listing::~sharded_listing()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_workers[i].join();
+    }
+}
+
+int sharded_listing::next_page(std::vector<list_blobs_hierarchical_item> &page)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        if (m_error != 0)
+        {
+            return m_error;
+        }
+        if (m_current == m_ranges.end())
+        {
+            page.clear();
+            return 0;
+        }
+        if (!m_current->pages.empty())
+        {
+            page.swap(m_current->pages.front());
+            m_current->pages.pop_front();
+            m_buffered_pages--;
+            m_cv.notify_all();
+            return 0;
+        }
+        if (m_current->finished && !m_current->fetching)
+        {
+            m_current = m_ranges.erase(m_current);
+            m_cv.notify_all();
+            continue;
+        }
+        m_cv.wait(lock);
+    }
+}
+
+void sharded_listing::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop && (m_error == 0))
+    {
+        auto work = find_work();
+        if (work == m_ranges.end())
+        {
+            m_cv.wait(lock);
+            continue;
+        }
+        work->fetching = true;
+        std::string prefix = work->prefix;
+        std::string continuation = work->continuation;
+        lock.unlock();
+
+        // A probe only needs to know whether the subdirectory has anything in it.
+        int max_results = work->probe ? 2 : max_list_results;
+        list_blobs_hierarchical_response response;
+        list_retry retry;
+        int error;
+        do
+        {
+            errno = 0;
+            response = azure_blob_client_wrapper->list_blobs_hierarchical(m_container, "/", continuation, prefix, max_results);
+            error = errno;
+        } while ((error != 0) && ((error = retry.wait(error)) == 0));
+
+        lock.lock();
+        work->fetching = false;
+        m_cv.notify_all();
+        if (error != 0)
+        {
+            if (AZS_PRINT)
+            {
+                fprintf(stdout, "Listing range %s failed with errno = %d\n", prefix.c_str(), error);
+            }
+            m_error = error;
+            break;
+        }
+
+        if (work->probe)
+        {
+            // Any names in the range make it a directory.
+            if (!response.blobs.empty())
+            {
+                list_blobs_hierarchical_item item;
+                item.name = work->prefix;
+                item.content_length = 0;
+                item.is_directory = true;
+                work->pages.push_back(std::vector<list_blobs_hierarchical_item>(1, item));
+                m_buffered_pages++;
+            }
+            else if (!response.next_marker.empty())
+            {
+                // The service can return an empty page before the end of the listing.
+                work->continuation = response.next_marker;
+                continue;
+            }
+            work->finished = true;
+            continue;
+        }
+
+        // The page has the blobs first, then the subdirectories, each in order; the last name listed is the greater of the two.
+        std::string last = work->start_after;
+        for (size_t i = 0; i < response.blobs.size(); i++)
+        {
+            last = std::max(last, response.blobs[i].name);
+        }
+        // Only a range that has listed some names can be split: those include the name that is the range's prefix itself, if there is one, which
+        // none of the smaller ranges would list.  The service can return an empty page before the end of the listing; carry on from its marker.
+        // Each smaller range costs a list request even if it's empty, so only split once the names listed show that the range branches at the
+        // next byte; names that share a long common prefix (such as "file000001", "file000002", ...) would leave all but one of them empty.
+        bool can_split = !response.blobs.empty();
+        size_t split_at = work->prefix.size();
+        bool branches = false;
+        int first_byte = -1;
+        for (size_t i = 0; (i < response.blobs.size()) && !branches; i++)
+        {
+            const std::string &name = response.blobs[i].name;
+            if (name.size() > split_at)
+            {
+                int byte = (unsigned char)name[split_at];
+                branches = (first_byte != -1) && (byte != first_byte);
+                first_byte = byte;
+            }
+        }
+        std::vector<list_blobs_hierarchical_item> page;
+        page.reserve(response.blobs.size());
+        for (size_t i = 0; i < response.blobs.size(); i++)
+        {
+            if (response.blobs[i].name > work->start_after)
+            {
+                page.push_back(std::move(response.blobs[i]));
+            }
+        }
+        if (!page.empty())
+        {
+            work->pages.push_back(std::move(page));
+            m_buffered_pages++;
+        }
+
+        if (response.next_marker.empty())
+        {
+            work->finished = true;
+        }
+        else if (can_split && branches && (work->depth < max_list_split_depth))
+        {
+            // The range takes more than one page; list the rest of it as smaller ranges.
+            split(std::next(work), work->prefix, last, work->depth + 1);
+            work->finished = true;
+        }
+        else
+        {
+            work->continuation = response.next_marker;
+        }
+    }
+}
+
+std::list<sharded_listing::range>::iterator sharded_listing::find_work()
+{
+    // The earliest range that needs a page fetched.  Don't fetch too far ahead of the reader, but always fetch the page the reader is waiting for.
+    for (auto iter = m_current; iter != m_ranges.end(); ++iter)
+    {
+        if (iter->fetching || iter->finished)
+        {
+            continue;
+        }
+        if ((m_buffered_pages < m_max_buffered_pages) || ((iter == m_current) && iter->pages.empty()))
+        {
+            return iter;
+        }
+        break;
+    }
+    return m_ranges.end();
+}
+
+// Whether the name ends partway through a multi-byte UTF-8 sequence.
+static bool in_utf8_sequence(const std::string &name)
+{
+    size_t trailing = 0;
+    size_t i = name.size();
+    while ((i > 0) && (((unsigned char)name[i - 1] & 0xC0) == 0x80) && (trailing < 3))
+    {
+        trailing++;
+        i--;
+    }
+    if (i == 0)
+    {
+        return false;
+    }
+    unsigned char lead = name[i - 1];
+    size_t needed = (lead >= 0xF0) ? 3 : (lead >= 0xE0) ? 2 : (lead >= 0xC0) ? 1 : 0;
+    return trailing < needed;
+}
+
+void sharded_listing::split(std::list<range>::iterator position, const std::string &prefix, const std::string &start_after, size_t depth)
+{
+    // Names are UTF-8, so after a lead byte only continuation bytes can follow, and elsewhere only ASCII bytes other than 0 and lead bytes can.
+    // The bytes are taken in the order the service lists names in.
+    bool continuation = in_utf8_sequence(prefix);
+    for (int c = 1; c < 256; c++)
+    {
+        bool is_continuation = (c >= 0x80) && (c <= 0xBF);
+        bool is_start = (c < 0x80) || ((c >= 0xC2) && (c <= 0xF4));
+        if (continuation ? !is_continuation : !is_start)
+        {
+            continue;
+        }
+        range child;
+        child.prefix = prefix + (char)c;
+        child.start_after = start_after;
+        child.depth = depth;
+        // Names in a subdirectory are grouped into a single entry, which is only listed if the subdirectory has any names in it.
+        child.probe = (c == '/');
+        child.fetching = false;
+        child.finished = false;
+
+        // Names up to start_after have already been listed, so skip the ranges that end before it.
+        bool listed = child.probe ? (child.prefix <= start_after) : ((child.prefix < start_after) && (start_after.compare(0, child.prefix.size(), child.prefix) != 0));
+        if (listed)
+        {
+            continue;
+        }
+        m_ranges.insert(position, child);
+    }
+}
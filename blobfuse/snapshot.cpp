@@ -0,0 +1,169 @@
+#include "blobfuse.h"
+
+std::shared_ptr<metadata_snapshot> metadata_snapshot::_instance;
+std::mutex metadata_snapshot::s_mutex;
+
+metadata_snapshot* metadata_snapshot::get_instance()
+{
+    if(nullptr == _instance.get())
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        if(nullptr == _instance.get())
+        {
+            _instance.reset(new metadata_snapshot());
+        }
+    }
+    return _instance.get();
+}
+
+void metadata_snapshot::start()
+{
+    // The file cache under the tmp path is removed when unmounting, but the snapshot is kept beside it.
+    if (attr_cache::get_instance()->load(file(), identity()))
+    {
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "Loaded the metadata snapshot %s\n", file().c_str());
+        }
+    }
+
+    m_threads.push_back(std::thread(&metadata_snapshot::run_saver, this));
+    for (int i = 0; i < metadata_revalidation_threads; i++)
+    {
+        m_threads.push_back(std::thread(&metadata_snapshot::run_revalidator, this));
+    }
+}
+
+void metadata_snapshot::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_threads.empty())
+        {
+            return;
+        }
+        m_stop = true;
+        m_cv.notify_all();
+    }
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        m_threads[i].join();
+    }
+    m_threads.clear();
+    save();
+}
+
+void metadata_snapshot::revalidate(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_threads.empty() || m_stop || (m_queue.size() >= max_revalidation_queue_size))
+    {
+        // A path that isn't queued now is queued again the next time it's looked up.
+        return;
+    }
+    if (m_queued.insert(path).second)
+    {
+        m_queue.push_back(path);
+        m_cv.notify_all();
+    }
+}
+
+std::string metadata_snapshot::file() const
+{
+    return str_options.tmpPath + "/metadata.snapshot";
+}
+
+std::string metadata_snapshot::identity() const
+{
+    return str_options.accountName + "/" + str_options.containerName;
+}
+
+void metadata_snapshot::save()
+{
+    if (!attr_cache::get_instance()->save(file(), identity()))
+    {
+        fprintf(stderr, "Failed to save the metadata snapshot %s, errno = %d\n", file().c_str(), errno);
+    }
+}
+
+void metadata_snapshot::run_saver()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cv.wait_for(lock, std::chrono::seconds(metadata_snapshot_interval_in_seconds), [this]() { return m_stop; }))
+    {
+        lock.unlock();
+        save();
+        lock.lock();
+    }
+}
+
+void metadata_snapshot::run_revalidator()
+{
+    while (true)
+    {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+            if (m_stop)
+            {
+                return;
+            }
+            path = m_queue.front();
+            m_queue.pop_front();
+            m_queued.erase(path);
+        }
+        revalidate_now(path);
+    }
+}
+
+void metadata_snapshot::revalidate_now(const std::string &path)
+{
+    struct stat stbuf;
+    bool unverified = false;
+    if (!attr_cache::get_instance()->get(path, &stbuf, &unverified) || !unverified)
+    {
+        return;
+    }
+
+    // On failure, the attributes are left unverified, and the path is queued again the next time it's looked up.
+    std::string blob = path.substr(1);
+    if (S_ISDIR(stbuf.st_mode))
+    {
+        errno = 0;
+        int dirStatus = is_directory_empty(str_options.containerName, "/", blob + "/");
+        if (errno != 0)
+        {
+            return;
+        }
+        if (dirStatus == D_NOTEXIST)
+        {
+            attr_cache::get_instance()->invalidate(path);
+        }
+        else
+        {
+            attr_cache::get_instance()->put(path, stbuf);
+        }
+        return;
+    }
+
+    errno = 0;
+    auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, blob);
+    if (errno != 0)
+    {
+        return;
+    }
+    if (!blob_property.valid())
+    {
+        attr_cache::get_instance()->invalidate(path);
+    }
+    else if (!attr_cache::get_instance()->verify(path, blob_property.etag))
+    {
+        if (AZS_PRINT)
+        {
+            fprintf(stdout, "Blob %s changed since the metadata snapshot was saved\n", path.c_str());
+        }
+        stbuf.st_size = blob_property.size;
+        attr_cache::get_instance()->put(path, stbuf, blob_property.etag);
+    }
+}
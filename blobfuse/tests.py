@@ -12,10 +12,15 @@ import stat
 import threading
 import fcntl
 import multiprocessing
+import hashlib
 
 class TestFuse(unittest.TestCase):
     blobdir = "/path/to/mount" # Path to the mounted container
+    otherblobdir = "/path/to/other/mount" # Path to a second mount of the same container, with its own temp directory.
+    filecachetimeout = 120 # The --file-cache-timeout-in-seconds that blobdir was mounted with.
     localdir = "/mnt/tmp" # A local temp directory, not the same one used by blobfuse.
+    tmppath = "/path/to/cache" # The --tmp-path that blobdir was mounted with.
+    cachesizemb = 0 # The --cache-size-in-mb that blobdir was mounted with, with the default watermarks of 90% and 80%.
     src = ""
     dest = ""
     blobstage = ""
@@ -360,6 +365,54 @@ class TestFuse(unittest.TestCase):
         os.remove(testFilePath)
         shutil.rmtree(testDirPath)
 
+    def test_read_directory_unusual_names(self):
+        # The names have to be escaped in the request URLs, both as the listing prefix and as blob names.
+        testDirName = u"Test Dir \u00e9t\u00e9"
+        testDirPath = os.path.join(self.blobstage, testDirName)
+        names = [u"file with spaces", u"caf\u00e9", u"\u65e5\u672c\u8a9e", u"100% & more", u"a+b=c"]
+
+        os.mkdir(testDirPath)
+        for name in names:
+            with open(os.path.join(testDirPath, name), 'w') as testFile:
+                testFile.write("test data")
+
+        entries = os.listdir(testDirPath)
+        self.assertEqual(sorted(entries), sorted(names))
+        for name in names:
+            self.assertEqual(os.stat(os.path.join(testDirPath, name)).st_size, len("test data"))
+
+        shutil.rmtree(testDirPath)
+
+    def test_file_operations_url_characters(self):
+        # Each of these characters means something in a URL, so a name that isn't escaped is truncated or rejected by the service.
+        names = ["with space", "per%cent", "per%25cent", "hash#tag", "question?mark"]
+        testDirPath = os.path.join(self.blobstage, "UrlCharacters")
+        os.mkdir(testDirPath)
+
+        for name in names:
+            testFilePath = os.path.join(testDirPath, name)
+            with open(testFilePath, 'w') as testFile:
+                testFile.write(name)
+        self.assertEqual(sorted(os.listdir(testDirPath)), sorted(names))
+
+        for name in names:
+            testFilePath = os.path.join(testDirPath, name)
+            os.rename(testFilePath, testFilePath + " renamed")
+        self.assertEqual(sorted(os.listdir(testDirPath)), sorted([name + " renamed" for name in names]))
+
+        # Read the blobs back from the service, rather than from this mount's cache, if there's a second mount.
+        readDirPath = testDirPath
+        if os.path.exists(self.otherblobdir):
+            readDirPath = os.path.join(self.otherblobdir, "testing", "UrlCharacters")
+        for name in names:
+            with open(os.path.join(readDirPath, name + " renamed"), 'r') as testFile:
+                self.assertEqual(testFile.read(), name)
+
+        for name in names:
+            os.remove(os.path.join(testDirPath, name + " renamed"))
+        self.assertEqual(os.listdir(testDirPath), [])
+        os.rmdir(testDirPath)
+
     def validate_dir_removal(self, dirPath, dirName, parentDir):
         with self.assertRaises(OSError) as e:
             os.stat(dirPath)
@@ -616,6 +669,32 @@ class TestFuse(unittest.TestCase):
         os.close(fd)
         os.remove(testFilePath)
 
+    def test_open_file_for_write_and_close_without_writing(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        with open(testFilePath, 'w') as testFile:
+            testFile.write("this version")
+        with open(otherFilePath, 'w') as otherFile:
+            otherFile.write("other version")
+
+        # This mount still has its own version in its cache.  Uploading it when nothing was written would replace the other client's version.
+        fd = os.open(testFilePath, os.O_WRONLY)
+        os.close(fd)
+        fd = os.open(testFilePath, os.O_RDWR)
+        os.fsync(fd)
+        os.close(fd)
+
+        # Once the other mount's cache times out, it keeps its copy only if the blob's ETag is still the one its own upload returned.
+        time.sleep(self.filecachetimeout + 5)
+        with open(otherFilePath, 'r') as otherFile:
+            self.assertEqual(otherFile.read(), "other version")
+
+        os.remove(testFilePath)
+
     def test_open_file_read_only_write_only(self):
         testFileName = "TestFile"
         testFilePath = os.path.join(self.blobstage, testFileName)
@@ -678,6 +757,118 @@ class TestFuse(unittest.TestCase):
         os.close(fd)
         os.remove(testFilePath)
 
+    def test_read_file_written_by_other_client_after_cache_timeout(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        with open(testFilePath, 'w') as testFile:
+            testFile.write("first version")
+        with open(testFilePath, 'r') as testFile:
+            self.assertEqual(testFile.read(), "first version")
+
+        # The other client changes both the contents and the size of the blob.
+        with open(otherFilePath, 'w') as otherFile:
+            otherFile.write("second, longer version")
+
+        time.sleep(self.filecachetimeout + 5)
+        self.assertEqual(os.stat(testFilePath).st_size, len("second, longer version"))
+        with open(testFilePath, 'r') as testFile:
+            self.assertEqual(testFile.read(), "second, longer version")
+
+        os.remove(testFilePath)
+
+    def test_read_file_written_by_both_clients_at_once_after_cache_timeout(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        # Each client's uploads race with the other's, so a write from one often lands between the other's upload and anything it does after.
+        def write_versions(path, name):
+            for i in range(0, 20):
+                with open(path, 'w') as f:
+                    f.write("%s version %d" % (name, i))
+        with open(testFilePath, 'w') as testFile:
+            testFile.write("first version")
+        threads = [threading.Thread(target=write_versions, args=(testFilePath, "this")),
+                   threading.Thread(target=write_versions, args=(otherFilePath, "other"))]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        # Once their caches time out, neither client may keep a version the blob no longer has.
+        time.sleep(self.filecachetimeout + 5)
+        with open(testFilePath, 'r') as testFile:
+            data = testFile.read()
+        with open(otherFilePath, 'r') as otherFile:
+            self.assertEqual(otherFile.read(), data)
+        self.assertIn(data, ["this version 19", "other version 19"])
+
+        os.remove(testFilePath)
+
+    def test_read_partial_file_rewritten_by_other_client(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        # Written through the other mount, so that this one fetches the blob block by block.
+        blockSize = 4 * 1024 * 1024
+        with open(otherFilePath, 'wb') as otherFile:
+            otherFile.write(b'a' * (16 * blockSize))
+
+        fd = os.open(testFilePath, os.O_RDONLY)
+        self.assertEqual(os.pread(fd, 10, 0), b'a' * 10)
+
+        with open(otherFilePath, 'wb') as otherFile:
+            otherFile.write(b'b' * (16 * blockSize))
+
+        # The rest of the old version is gone; its blocks must not be mixed with the new one's.
+        with self.assertRaises(OSError) as e:
+            os.pread(fd, 10, 15 * blockSize)
+        self.assertIn(e.exception.errno, (errno.ESTALE, errno.EIO))
+        os.close(fd)
+
+        with open(testFilePath, 'rb') as testFile:
+            testFile.seek(15 * blockSize)
+            self.assertEqual(testFile.read(10), b'b' * 10)
+
+        os.remove(testFilePath)
+
+    def test_read_large_file_random_offsets(self):
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+
+        # Written through the other mount if there is one, or else read once this mount's cache has timed out, so that the blocks are fetched as they're read.
+        blockSize = 4 * 1024 * 1024
+        size = 20 * blockSize + 12345
+        if os.path.exists(self.otherblobdir):
+            data = self.write_large_file(os.path.join(self.otherblobdir, "testing", testFileName), size)
+        else:
+            data = self.write_large_file(testFilePath, size)
+            time.sleep(self.filecachetimeout + 5)
+
+        # Reads within a block, across the boundary between blocks, and past the end of the file, in no particular order.
+        fd = os.open(testFilePath, os.O_RDONLY)
+        offsets = [random.randrange(0, size) for i in range(0, 30)] + [blockSize - 10, 7 * blockSize - 1, 20 * blockSize, size - 100]
+        random.shuffle(offsets)
+        for offset in offsets:
+            length = random.choice([1, 4096, 100000, blockSize + 1])
+            self.assertEqual(os.pread(fd, length, offset), bytes(data[offset:offset + length]))
+        os.close(fd)
+
+        # A full read after the random ones gets the same data as one from the start.
+        self.assertEqual(os.stat(testFilePath).st_size, size)
+        self.assertEqual(self.read_file_checksum(testFilePath), hashlib.md5(data).hexdigest())
+
+        os.remove(testFilePath)
+
     def test_write_file_overwrite_beginning(self):
         testFileName = "TestFile"
         testFilePath = os.path.join(self.blobstage, testFileName)
@@ -718,6 +909,142 @@ class TestFuse(unittest.TestCase):
         os.close(fd)
         os.remove(testFilePath)
 
+    def test_write_large_file_sequentially(self):
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+
+        # Well past the size at which blocks are uploaded while the file is still being written.
+        chunkSize = 1024 * 1024
+        chunkCount = 200
+        written = hashlib.md5()
+        fd = os.open(testFilePath, os.O_CREAT | os.O_WRONLY)
+        for i in range(0, chunkCount):
+            chunk = os.urandom(chunkSize)
+            written.update(chunk)
+            os.write(fd, chunk)
+        os.close(fd)
+        self.assertEqual(os.stat(testFilePath).st_size, chunkSize * chunkCount)
+
+        # Check what was committed to the blob, rather than what's in this mount's cache: read it through the second mount if there is one,
+        # or else once this mount's cache has timed out and the file has to be fetched again.
+        readFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+        if not os.path.exists(self.otherblobdir):
+            readFilePath = testFilePath
+            time.sleep(self.filecachetimeout + 5)
+        self.assertEqual(os.stat(readFilePath).st_size, chunkSize * chunkCount)
+        read = hashlib.md5()
+        fd = os.open(readFilePath, os.O_RDONLY)
+        data = os.read(fd, chunkSize)
+        while len(data) > 0:
+            read.update(data)
+            data = os.read(fd, chunkSize)
+        os.close(fd)
+        self.assertEqual(read.hexdigest(), written.hexdigest())
+
+        os.remove(testFilePath)
+
+    def write_large_file(self, path, size):
+        data = bytearray(os.urandom(size))
+        with open(path, 'wb') as f:
+            f.write(data)
+        return data
+
+    def read_file_checksum(self, path):
+        checksum = hashlib.md5()
+        with open(path, 'rb') as f:
+            data = f.read(1024 * 1024)
+            while len(data) > 0:
+                checksum.update(data)
+                data = f.read(1024 * 1024)
+        return checksum.hexdigest()
+
+    def test_write_middle_of_large_file(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        # Large enough to be uploaded in blocks, so that changing the middle of it only uploads the blocks that changed.
+        size = 80 * 1024 * 1024
+        data = self.write_large_file(testFilePath, size)
+
+        offset = 40 * 1024 * 1024 + 12345
+        change = os.urandom(1024 * 1024)
+        with open(testFilePath, 'r+b') as testFile:
+            testFile.seek(offset)
+            testFile.write(change)
+        data[offset:offset + len(change)] = change
+
+        self.assertEqual(os.stat(otherFilePath).st_size, size)
+        self.assertEqual(self.read_file_checksum(otherFilePath), hashlib.md5(data).hexdigest())
+
+        os.remove(testFilePath)
+
+    def test_write_middle_of_large_file_changed_by_other_client(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        testFileName = "TestFile"
+        testFilePath = os.path.join(self.blobstage, testFileName)
+        otherFilePath = os.path.join(self.otherblobdir, "testing", testFileName)
+
+        size = 80 * 1024 * 1024
+        data = self.write_large_file(testFilePath, size)
+        # The other client replaces the blob, so the blocks this mount would keep are no longer the blob's.
+        self.write_large_file(otherFilePath, size)
+
+        offset = 40 * 1024 * 1024 + 12345
+        change = os.urandom(1024 * 1024)
+        with open(testFilePath, 'r+b') as testFile:
+            testFile.seek(offset)
+            testFile.write(change)
+        data[offset:offset + len(change)] = change
+
+        # The partial upload must fail its precondition, and the whole file be uploaded instead: the blob is this mount's version, not a mix of both.
+        time.sleep(self.filecachetimeout + 5)
+        self.assertEqual(os.stat(otherFilePath).st_size, size)
+        self.assertEqual(self.read_file_checksum(otherFilePath), hashlib.md5(data).hexdigest())
+
+        os.remove(testFilePath)
+
+    def cache_usage(self):
+        usage = 0
+        for root, dirs, files in os.walk(os.path.join(self.tmppath, "root")):
+            for name in files:
+                usage += os.stat(os.path.join(root, name)).st_blocks * 512
+        return usage
+
+    def test_cache_eviction_watermarks(self):
+        if self.cachesizemb == 0 or not os.path.exists(self.tmppath):
+            self.skipTest("needs a mount with a bounded file cache")
+        cacheSize = self.cachesizemb * 1024 * 1024
+        fileSize = cacheSize // 8
+
+        # Half again as much as the cache can hold, written oldest first.
+        fileCount = 12
+        for i in range(0, fileCount):
+            with open(os.path.join(self.blobstage, "TestFile%d" % i), 'wb') as testFile:
+                testFile.write(os.urandom(fileSize))
+
+        # Eviction runs every second; it stops once the cache is back below the low watermark.
+        time.sleep(5)
+        usage = self.cache_usage()
+        self.assertLessEqual(usage, cacheSize * 80 // 100)
+        self.assertGreaterEqual(usage, cacheSize * 80 // 100 - fileSize)
+
+        # The least recently used files went first.
+        cachedDir = os.path.join(self.tmppath, "root", "testing")
+        self.assertFalse(os.path.exists(os.path.join(cachedDir, "TestFile0")))
+        self.assertTrue(os.path.exists(os.path.join(cachedDir, "TestFile%d" % (fileCount - 1))))
+
+        # Evicted files are fetched again when they're read.
+        self.assertEqual(os.stat(os.path.join(self.blobstage, "TestFile0")).st_size, fileSize)
+        with open(os.path.join(self.blobstage, "TestFile0"), 'rb') as testFile:
+            self.assertEqual(len(testFile.read()), fileSize)
+
+        for i in range(0, fileCount):
+            os.remove(os.path.join(self.blobstage, "TestFile%d" % i))
+
     def test_close_file(self):
         testFileName = "TestFile"
         testFilePath = os.path.join(self.blobstage, testFileName)
@@ -905,6 +1232,89 @@ class TestFuse(unittest.TestCase):
         os.remove(os.path.join(destDirPath, testFileName))
         os.rmdir(destDirPath)
 
+    def test_rename_dir_many_files(self):
+        testDirName = "TestDir"
+        testDirPath = os.path.join(self.blobstage, testDirName)
+        destDirName = "NewName"
+        destDirPath = os.path.join(self.blobstage, destDirName)
+
+        # More files than the service returns in one listing page.  They're created through the other mount if there is one,
+        # so that this mount only finds them by listing the service.
+        fileCount = 5100
+        createDirPath = testDirPath
+        if os.path.exists(self.otherblobdir):
+            createDirPath = os.path.join(self.otherblobdir, "testing", testDirName)
+        os.mkdir(createDirPath)
+        for i in range(0, fileCount):
+            with open(os.path.join(createDirPath, "file" + str(i)), 'w') as testFile:
+                testFile.write(str(i))
+
+        os.rename(testDirPath, destDirPath)
+
+        self.validate_dir_removal(testDirPath, testDirName, self.blobstage)
+        entries = os.listdir(destDirPath)
+        self.assertEqual(len(entries), fileCount)
+        self.assertEqual(len(set(entries)), fileCount)
+        for i in range(0, fileCount, 1000):
+            with open(os.path.join(destDirPath, "file" + str(i)), 'r') as testFile:
+                self.assertEqual(testFile.read(), str(i))
+
+        shutil.rmtree(destDirPath)
+
+    def validate_namespace_operations(self, testDirPath, fileCount, warm):
+        # Created through the other mount, so that this mount only knows of the files from the service.
+        createDirPath = os.path.join(self.otherblobdir, "testing", os.path.basename(testDirPath))
+        os.mkdir(createDirPath)
+        os.mkdir(os.path.join(createDirPath, "subdir"))
+        for i in range(0, fileCount):
+            with open(os.path.join(createDirPath, "file" + str(i)), 'w') as testFile:
+                testFile.write(str(i))
+
+        # A warm mount has already listed the directory and looked up its entries, so its caches hold them; a cold one hasn't.
+        if warm:
+            os.listdir(testDirPath)
+            for i in range(0, fileCount):
+                os.stat(os.path.join(testDirPath, "file" + str(i)))
+            with self.assertRaises(OSError) as e:
+                os.stat(os.path.join(testDirPath, "renamed0"))
+            self.assertEqual(e.exception.errno, errno.ENOENT)
+
+        expected = set(["file" + str(i) for i in range(0, fileCount)] + ["subdir"])
+        self.assertEqual(set(os.listdir(testDirPath)), expected)
+        for i in range(0, fileCount):
+            self.assertEqual(os.stat(os.path.join(testDirPath, "file" + str(i))).st_size, len(str(i)))
+        self.assertTrue(stat.S_ISDIR(os.stat(os.path.join(testDirPath, "subdir")).st_mode))
+        with self.assertRaises(OSError) as e:
+            os.stat(os.path.join(testDirPath, "missing"))
+        self.assertEqual(e.exception.errno, errno.ENOENT)
+
+        # The renamed files must be seen under their new names, and not under their old ones, by this mount's listing and getattr, and by the other mount.
+        for i in range(0, fileCount, 10):
+            os.rename(os.path.join(testDirPath, "file" + str(i)), os.path.join(testDirPath, "renamed" + str(i)))
+        for i in range(0, fileCount, 10):
+            expected.remove("file" + str(i))
+            expected.add("renamed" + str(i))
+            with self.assertRaises(OSError) as e:
+                os.stat(os.path.join(testDirPath, "file" + str(i)))
+            self.assertEqual(e.exception.errno, errno.ENOENT)
+            self.assertEqual(os.stat(os.path.join(testDirPath, "renamed" + str(i))).st_size, len(str(i)))
+            with open(os.path.join(testDirPath, "renamed" + str(i)), 'r') as testFile:
+                self.assertEqual(testFile.read(), str(i))
+        self.assertEqual(set(os.listdir(testDirPath)), expected)
+        self.assertEqual(set(os.listdir(createDirPath)), expected)
+
+        shutil.rmtree(testDirPath)
+
+    def test_namespace_operations_cold_mount(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        self.validate_namespace_operations(os.path.join(self.blobstage, "TestDir"), 100, False)
+
+    def test_namespace_operations_warm_mount(self):
+        if not os.path.exists(self.otherblobdir):
+            self.skipTest("needs a second mount of the container")
+        self.validate_namespace_operations(os.path.join(self.blobstage, "TestDir"), 100, True)
+
     # TODO: implement flock
     '''
     def test_file_lock_shared(self):
@@ -14,6 +14,32 @@ int map_errno(int error)
     }
 }
 
+list_retry::list_retry() : m_start(std::chrono::steady_clock::now()), m_attempts(0), m_seed((unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)this)
+{
+}
+
+int list_retry::wait(int error)
+{
+    // errno is the HTTP status code if the service answered, and a small curl error code if the request didn't get an answer.
+    bool transient = (error < 100) || (error == 408) || (error == 429) || ((error >= 500) && (error < 600) && (error != 501) && (error != 505));
+    if (!transient)
+    {
+        return error;
+    }
+
+    // Full jitter: wait a random time up to the current delay.
+    unsigned long long delay_ms = std::min<unsigned long long>((unsigned long long)min_list_retry_delay_ms << std::min(m_attempts, 16u), max_list_retry_delay_ms);
+    delay_ms = rand_r(&m_seed) % (delay_ms + 1);
+    m_attempts++;
+    auto deadline = m_start + std::chrono::seconds(max_list_retry_seconds);
+    if (std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms) >= deadline)
+    {
+        return EIO;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    return 0;
+}
+
 std::string prepend_mnt_path_string(const std::string path)
 {
     return str_options.tmpPath + "/root" + path;
@@ -86,8 +112,26 @@ std::vector<list_blobs_hierarchical_item> list_all_blobs_hierarchical(std::strin
                 {
                     std::advance(begin, 1);
                 }
-                results.insert(results.end(), begin, response.blobs.end());
-                prior = response.blobs.back().name;
+                // The page has the blobs first, then the subdirectories; the listing continues after the greatest name in it.
+                for (size_t i = 0; i < response.blobs.size(); i++)
+                {
+                    prior = std::max(prior, response.blobs[i].name);
+                }
+                results.insert(results.end(), std::make_move_iterator(begin), std::make_move_iterator(response.blobs.end()));
+            }
+
+            if ((continuation.size() > 0) && (list_parallelism > 1) && (delimiter == "/") && (prior.size() > 0))
+            {
+                // The directory is large; list the rest of it concurrently.
+                sharded_listing sharded(container, prefix, prior, continuation, list_parallelism);
+                std::vector<list_blobs_hierarchical_item> page;
+                int ret;
+                while (((ret = sharded.next_page(page)) == 0) && !page.empty())
+                {
+                    results.insert(results.end(), std::make_move_iterator(page.begin()), std::make_move_iterator(page.end()));
+                }
+                errno = ret;
+                return results;
             }
         }
         else
@@ -123,7 +167,8 @@ int is_directory_empty(std::string container, std::string delimiter, std::string
     do
     {
         errno = 0;
-        list_blobs_hierarchical_response response = azure_blob_client_wrapper->list_blobs_hierarchical(container, delimiter, continuation, prefix);
+        // Two names are enough to tell an empty directory (which may have only its marker blob) from a non-empty one.
+        list_blobs_hierarchical_response response = azure_blob_client_wrapper->list_blobs_hierarchical(container, delimiter, continuation, prefix, 2);
         if (errno == 0)
         {
             success = true;
@@ -153,7 +198,7 @@ int is_directory_empty(std::string container, std::string delimiter, std::string
             success = false;
             failcount++; //TODO: use to set errno.
         }
-    } while ((continuation.size() > 0) && !success && (failcount < 20));
+    } while (((continuation.size() > 0) || !success) && (failcount < 20));
 
     if (!success)
     {
@@ -165,6 +210,67 @@ int is_directory_empty(std::string container, std::string delimiter, std::string
 }
 
 
+// Finds out whether a blob name is a blob, a directory, or neither, with a single list request in the common case, rather than a HEAD request and then a list request.
+// Listing with the name as the prefix returns the blob of that name, if any, before the directory of that name (a BlobPrefix ending in '/'), if any.
+// Only other names that start with the name followed by a character that sorts before '/' (such as "name.txt") come between them.
+// A blob takes precedence over a directory of the same name, as in azs_getattr().
+static int getattr_from_listing(const std::string &pathString, const std::string &blobName, struct stat *stbuf)
+{
+    std::string dirName = blobName + "/";
+    std::string continuation;
+    int max_results = getattr_list_results;
+    do
+    {
+        errno = 0;
+        list_blobs_hierarchical_response response = azure_blob_client_wrapper->list_blobs_hierarchical(str_options.containerName, "/", continuation, blobName, max_results);
+        if (errno != 0)
+        {
+            return 0 - map_errno(errno);
+        }
+
+        // The blobs and the directories of a page are not interleaved, so the whole page is checked before deciding.
+        bool dirFound = false;
+        bool passed = false;
+        for (size_t i = 0; i < response.blobs.size(); i++)
+        {
+            const list_blobs_hierarchical_item &item = response.blobs[i];
+            if (!item.is_directory && (item.name == blobName))
+            {
+                stbuf->st_mode = S_IFREG | 0770; // Regular file (not a directory)
+                stbuf->st_nlink = 1;
+                stbuf->st_size = item.content_length;
+                return 0;
+            }
+            if (item.is_directory && (item.name == dirName))
+            {
+                dirFound = true;
+            }
+            if (item.name >= dirName)
+            {
+                passed = true;
+            }
+        }
+        if (dirFound)
+        {
+            // As with directories found by readdir, we can't tell from the listing whether the directory is empty, so it's reported as not empty.
+            stbuf->st_mode = S_IFDIR | 0770;
+            stbuf->st_nlink = 3;
+            stbuf->st_size = 4096;
+            return 0;
+        }
+        if (passed)
+        {
+            break;
+        }
+        continuation = response.next_marker;
+        // Further pages are only needed when there are many such names; fetch them in full.
+        max_results = max_list_results;
+    } while (!continuation.empty());
+
+    attr_cache::get_instance()->put_negative(pathString);
+    return -(ENOENT);
+}
+
 int azs_getattr(const char *path, struct stat *stbuf)
 {
     if (AZS_PRINT)
@@ -203,8 +309,30 @@ int azs_getattr(const char *path, struct stat *stbuf)
         return 0;
     }
 
-    // It's not in the local cache.  Check to see if it's a blob on the service:
+    // It's not in the local cache.  If it was found by a recent listing, use the attributes from that.
+    bool unverified = false;
+    if (attr_cache::get_instance()->get(pathString, stbuf, &unverified))
+    {
+        if (unverified)
+        {
+            // They came from the snapshot of an earlier mount.  Use them now, and check them against the service in the background.
+            metadata_snapshot::get_instance()->revalidate(pathString);
+        }
+        return 0;
+    }
+    if (attr_cache::get_instance()->is_negative(pathString))
+    {
+        return -(ENOENT);
+    }
+
     std::string blobNameStr(&(path[1]));
+    std::string dirNameStr = blobNameStr + "/";
+    if (concurrent_getattr)
+    {
+        return getattr_from_listing(pathString, blobNameStr, stbuf);
+    }
+
+    // Check to see if it's a blob on the service:
     errno = 0;
     auto blob_property = azure_blob_client_wrapper->get_blob_property(str_options.containerName, blobNameStr);
 
@@ -222,10 +350,8 @@ int azs_getattr(const char *path, struct stat *stbuf)
     else if (errno == 0 && !blob_property.valid())
     {
         // Check to see if it's a directory, instead of a file
-        blobNameStr.push_back('/');
-
         errno = 0;
-        int dirSize = is_directory_empty(str_options.containerName, "/", blobNameStr);
+        int dirSize = is_directory_empty(str_options.containerName, "/", dirNameStr);
 
         if (errno != 0)
         {
@@ -239,7 +365,7 @@ int azs_getattr(const char *path, struct stat *stbuf)
         {
             if (AZS_PRINT)
             {
-                fprintf(stdout, "Directory %s found with return value: %d!\n", blobNameStr.c_str(), dirSize);
+                fprintf(stdout, "Directory %s found with return value: %d!\n", dirNameStr.c_str(), dirSize);
             }
             stbuf->st_mode = S_IFDIR | 0770;
             // If st_nlink = 2, means direcotry is empty.
@@ -250,6 +376,7 @@ int azs_getattr(const char *path, struct stat *stbuf)
         }
         else
         {
+            attr_cache::get_instance()->put_negative(pathString);
             return -(ENOENT); // -2 = Entity does not exist.
         }
     }
@@ -278,6 +405,17 @@ int rm(const char *fpath, const struct stat * /*sb*/, int tflag, struct FTW * /*
 // Delete the entire contents of tmpPath.
 void azs_destroy(void * /*private_data*/)
 {
+    file_cache_map::get_instance()->stop_eviction();
+    listing_prefetcher::get_instance()->stop();
+    metadata_snapshot::get_instance()->stop();
+
+    if (AZS_PRINT)
+    {
+        curl_connection_stats stats = azure_blob_client_wrapper->connection_stats();
+        fprintf(stdout, "%llu requests made %llu new connections, with %llu TLS handshakes taking %llu ms in total\n",
+            stats.transfers, stats.new_connections, stats.tls_handshakes, stats.tls_handshake_microseconds / 1000);
+    }
+
     std::string rootPath(str_options.tmpPath + "/root");
     char *cstr = (char *)malloc(rootPath.size() + 1);
     memcpy(cstr, rootPath.c_str(), rootPath.size());
@@ -480,6 +618,12 @@ int azs_rename(const char *src, const char *dst)
     {
         azs_rename_single_file(src, dst);
     }
+    attr_cache::get_instance()->invalidate_tree(src);
+    attr_cache::get_instance()->invalidate_tree(dst);
+    listing_cache::get_instance()->invalidate_parent(src);
+    listing_cache::get_instance()->invalidate_parent(dst);
+    listing_cache::get_instance()->invalidate_tree(src);
+    listing_cache::get_instance()->invalidate_tree(dst);
 
     return 0;
 }
@@ -0,0 +1,194 @@
+#include "blobfuse.h"
+#include <fcntl.h>
+#include "base64.h"
+
+// Block IDs have the same form as the ones generated by upload_file_to_blob, so that a blob can be re-uploaded by either path.
+static std::string block_id(size_t index)
+{
+    std::string id = std::to_string(index);
+    id = std::string(44 - id.length(), 'a').append(id);
+    return to_base64(std::vector<unsigned char>(id.begin(), id.end()));
+}
+
+write_behind::write_behind(std::shared_ptr<file_cache_entry> cache_entry, unsigned long long writer_epoch, const std::string &mntPath)
+    : m_cache_entry(cache_entry), m_writer_epoch(writer_epoch), m_blob(cache_entry->get_blob()), m_written(0), m_staged_blocks(0), m_abandoned(false)
+{
+    m_fd = open(mntPath.c_str(), O_RDONLY);
+    if (m_fd == -1)
+    {
+        m_abandoned = true;
+    }
+}
+
+write_behind::~write_behind()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    wait_for_uploads();
+    if (m_fd != -1)
+    {
+        close(m_fd);
+    }
+}
+
+void write_behind::on_write(off_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_abandoned)
+    {
+        return;
+    }
+
+    unsigned long long start = offset;
+    unsigned long long end = start + size;
+    if (start < m_staged_blocks * cache_block_size)
+    {
+        // This block has already been uploaded, with the old data.
+        abandon();
+        return;
+    }
+
+    // With multiple FUSE threads, writes from a sequential writer can be processed slightly out of order; keep track of them until the gap is filled.
+    if (start <= m_written)
+    {
+        m_written = std::max(m_written, end);
+    }
+    else
+    {
+        unsigned long long &pending_end = m_pending[start];
+        pending_end = std::max(pending_end, end);
+        if (m_pending.size() > 64)
+        {
+            abandon();
+            return;
+        }
+    }
+    while (!m_pending.empty() && (m_pending.begin()->first <= m_written))
+    {
+        m_written = std::max(m_written, m_pending.begin()->second);
+        m_pending.erase(m_pending.begin());
+    }
+
+    if (m_written <= single_upload_threshold)
+    {
+        return;
+    }
+    while (!m_abandoned && ((m_staged_blocks + 1) * cache_block_size <= m_written))
+    {
+        if (m_staged_blocks >= max_block_count)
+        {
+            abandon();
+            return;
+        }
+        stage_block(m_staged_blocks, cache_block_size);
+        m_staged_blocks++;
+    }
+}
+
+bool write_behind::commit(const std::string &blob, unsigned long long size, std::string &etag)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_abandoned || (size <= single_upload_threshold))
+    {
+        return false;
+    }
+    if ((blob != m_blob) || (size != m_written) || !m_pending.empty() || !m_cache_entry->is_sole_writer(m_writer_epoch))
+    {
+        // The file was renamed, or modified other than through this handle.
+        abandon();
+        return false;
+    }
+
+    while (!m_abandoned && ((m_staged_blocks + 1) * cache_block_size <= size))
+    {
+        stage_block(m_staged_blocks, cache_block_size);
+        m_staged_blocks++;
+    }
+    size_t block_count = m_staged_blocks;
+    if (size > m_staged_blocks * cache_block_size)
+    {
+        // The last block is partial, so it isn't counted in m_staged_blocks; if the file is written further, it is staged again.
+        stage_block(m_staged_blocks, size - m_staged_blocks * cache_block_size);
+        block_count++;
+    }
+    if (block_count > max_block_count)
+    {
+        abandon();
+        return false;
+    }
+    if (!wait_for_uploads() || m_abandoned)
+    {
+        abandon();
+        return false;
+    }
+
+    std::vector<put_block_list_request_base::block_item> block_list;
+    for (size_t i = 0; i < block_count; i++)
+    {
+        put_block_list_request_base::block_item block;
+        block.id = block_id(i);
+        // Blocks committed by an earlier flush are used as-is, unless they have been staged again since.
+        block.type = put_block_list_request_base::block_type::latest;
+        block_list.push_back(block);
+    }
+
+    if (AZS_PRINT)
+    {
+        fprintf(stdout, "Committing %lu staged blocks to blob %s\n", block_count, blob.c_str());
+    }
+    errno = 0;
+    etag = azure_blob_client_wrapper->put_block_list(str_options.containerName, blob, block_list);
+    if (errno != 0)
+    {
+        abandon();
+        return false;
+    }
+    return true;
+}
+
+void write_behind::abandon()
+{
+    if (AZS_PRINT && !m_abandoned)
+    {
+        fprintf(stdout, "Abandoning write-behind for blob %s, the file will be uploaded in full on flush\n", m_blob.c_str());
+    }
+    m_abandoned = true;
+    m_pending.clear();
+}
+
+void write_behind::stage_block(size_t index, size_t length)
+{
+    // Bound the number of blocks in flight.  This also slows down the writer, if it's writing faster than we can upload.
+    if (m_uploads.size() >= (size_t)upload_parallelism)
+    {
+        int ret = m_uploads.front().get();
+        m_uploads.erase(m_uploads.begin());
+        if (ret != 0)
+        {
+            abandon();
+            return;
+        }
+    }
+
+    int fd = m_fd;
+    std::string blob = m_blob;
+    m_uploads.push_back(std::async(std::launch::async, [fd, blob, index, length]()
+    {
+        errno = 0;
+        azure_blob_client_wrapper->upload_block_from_source(str_options.containerName, blob, block_id(index), std::make_shared<storage_fd_source>(fd, index * cache_block_size, length));
+        return errno;
+    }));
+}
+
+bool write_behind::wait_for_uploads()
+{
+    bool success = true;
+    for (size_t i = 0; i < m_uploads.size(); i++)
+    {
+        if (m_uploads[i].get() != 0)
+        {
+            success = false;
+        }
+    }
+    m_uploads.clear();
+    return success;
+}